@@ -0,0 +1,368 @@
+/*
+ * burst_detector.h
+ *
+ * streaming double-sliding-window burst onset/end detector
+ *
+ * Streaming version of double_window.m: for every sample the detector
+ * compares the summed magnitude of the most recent W samples with the
+ * W+1 samples before them.  Both sums are kept as running sums, so each
+ * sample costs O(1) regardless of the window length.  The magnitude of
+ * the interleaved cshort I/Q samples is computed with SSE2, or AVX2 when
+ * the cpu has it.
+ *
+ * Once the ratio (later window / earlier window) exceeds the threshold,
+ * the detector searches the next W samples for the peak ratio and
+ * reports its position as the onset: the index of the first sample of
+ * the later window.  It re-arms when the ratio drops below the
+ * threshold again.  Burst ends are found the same way from the inverse
+ * ratio (earlier window / later window).
+ *
+ * Onset and end edges are paired into bursts by a burst_tracker: an
+ * onset opens a burst, the next end closes it.  The offline analyzer
+ * feeds the same tracker with edges found by several threads.
+ */
+
+#ifndef __BURST_DETECTOR_H__
+#define __BURST_DETECTOR_H__
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <ostream>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+// |x| for _n interleaved 16-bit I/Q samples, portable/SSE2 version;
+// pmaddwd gives i*i + q*q per sample exactly (the single overflow case,
+// -32768 on both rails, wraps to -2^31 and is fixed by clearing the sign)
+inline void burst_magnitude_sc16_sse2(const short *_x, float *_y, unsigned int _n)
+{
+    unsigned int i = 0;
+#ifdef __SSE2__
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    for (; i + 4 <= _n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(_x + 2*i));
+        __m128 p  = _mm_and_ps(_mm_cvtepi32_ps(_mm_madd_epi16(v, v)), abs_mask);
+        _mm_storeu_ps(_y + i, _mm_sqrt_ps(p));
+    }
+#endif
+    for (; i < _n; i++) {
+        float re = _x[2*i];
+        float im = _x[2*i+1];
+        _y[i] = sqrtf(re*re + im*im);
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BURST_HAVE_AVX2_KERNEL 1
+
+// AVX2 version: eight samples per iteration
+__attribute__((target("avx2")))
+inline void burst_magnitude_sc16_avx2(const short *_x, float *_y, unsigned int _n)
+{
+    unsigned int i = 0;
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    for (; i + 8 <= _n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(_x + 2*i));
+        __m256 p  = _mm256_and_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(v, v)), abs_mask);
+        _mm256_storeu_ps(_y + i, _mm256_sqrt_ps(p));
+    }
+    burst_magnitude_sc16_sse2(_x + 2*i, _y + i, _n - i);
+}
+#endif
+
+// |x| for _n interleaved 16-bit I/Q samples, using the widest kernel
+// the cpu supports
+inline void burst_magnitude_sc16(const short *_x, float *_y, unsigned int _n)
+{
+#ifdef BURST_HAVE_AVX2_KERNEL
+    static const bool have_avx2 = __builtin_cpu_supports("avx2");
+    if (have_avx2) {
+        burst_magnitude_sc16_avx2(_x, _y, _n);
+        return;
+    }
+#endif
+    burst_magnitude_sc16_sse2(_x, _y, _n);
+}
+
+enum burst_edge_type {
+    BURST_EDGE_ONSET = 0,
+    BURST_EDGE_END
+};
+
+// a detected onset or end
+struct burst_edge {
+    int type;                   // burst_edge_type
+    unsigned long long index;   // first sample of the later window
+    double ratio;               // peak ratio at the edge
+};
+
+inline bool burst_edge_less(const burst_edge &_a, const burst_edge &_b)
+{
+    return _a.index < _b.index;
+}
+
+// one burst
+struct burst_record {
+    unsigned long long start;   // onset sample
+    unsigned long long end;     // end sample (one past the last burst sample)
+    double peak_power;          // peak W-window mean |y|^2 in the burst
+};
+
+// threshold crossing plus peak search for one edge type
+struct burst_edge_search {
+    bool armed;
+    bool searching;
+    unsigned long long search_end;
+    unsigned long long peak_index;
+    double peak_ratio;
+};
+
+inline void burst_edge_search_reset(burst_edge_search *_s)
+{
+    _s->armed     = true;
+    _s->searching = false;
+}
+
+// feed the ratio at window position _k (later window starts at _start);
+// returns true once the peak search over the following _window samples
+// has completed and peak_index/peak_ratio hold the edge
+inline bool burst_edge_search_update(burst_edge_search *_s,
+                                     double _ratio,
+                                     float _threshold,
+                                     unsigned long long _k,
+                                     unsigned long long _start,
+                                     unsigned int _window)
+{
+    if (_s->searching) {
+        if (_ratio > _s->peak_ratio) {
+            _s->peak_ratio = _ratio;
+            _s->peak_index = _start;
+        }
+        if (_k >= _s->search_end) {
+            _s->searching = false;
+            return true;
+        }
+    } else if (_s->armed) {
+        if (_ratio > _threshold) {
+            _s->armed      = false;
+            _s->searching  = true;
+            _s->peak_ratio = _ratio;
+            _s->peak_index = _start;
+            _s->search_end = _k + _window;
+        }
+    } else if (_ratio < _threshold) {
+        _s->armed = true;
+    }
+    return false;
+}
+
+// pairs onset/end edges into bursts
+struct burst_tracker {
+    bool in_burst;
+    burst_record current;
+    std::vector<burst_record> bursts;
+};
+
+inline void burst_tracker_init(burst_tracker *_t)
+{
+    _t->in_burst = false;
+    _t->bursts.clear();
+}
+
+// returns true if the edge closed a burst (now bursts.back())
+inline bool burst_tracker_edge(burst_tracker *_t, const burst_edge &_e)
+{
+    if (_e.type == BURST_EDGE_ONSET && !_t->in_burst) {
+        _t->in_burst = true;
+        _t->current.start = _e.index;
+        _t->current.end   = _e.index;
+        _t->current.peak_power = 0.0;
+    } else if (_e.type == BURST_EDGE_END && _t->in_burst) {
+        _t->in_burst = false;
+        _t->current.end = _e.index;
+        _t->bursts.push_back(_t->current);
+        return true;
+    }
+    return false;
+}
+
+// per-burst table: start, end, duration [samples] and peak power [dB]
+inline void burst_write_table(std::ostream &_os, const std::vector<burst_record> &_bursts)
+{
+    _os << "bursts: " << _bursts.size() << std::endl;
+    for (unsigned int i=0; i<_bursts.size(); i++) {
+        const burst_record &b = _bursts[i];
+        _os << "burst " << i
+            << " start: " << b.start
+            << " end: " << b.end
+            << " duration: " << (b.end - b.start)
+            << " peak power: " << 10.0*log10(b.peak_power > 0.0 ? b.peak_power : 1e-30) << " dB"
+            << std::endl;
+    }
+}
+
+struct burst_detector {
+    unsigned int window;        // window length W [samples]
+    float threshold;            // onset/end ratio threshold
+
+    // magnitude history: the last 2W+1 samples, oldest at hist_pos
+    std::vector<float> hist;
+    unsigned int hist_pos;
+    double sum1;                // earlier window (W+1 samples)
+    double sum2;                // later window (W samples)
+    double sum2_sq;             // later window, sum of |y|^2
+    unsigned long long filled;  // samples seen since the last reset
+
+    unsigned long long index;   // stream index of the next sample
+
+    burst_edge_search onset;
+    burst_edge_search end;
+    std::vector<burst_edge> edges;
+    burst_tracker tracker;
+    double peak_power;          // running peak while a burst is open
+
+    std::ostream *log;          // live report (may be NULL)
+    std::vector<float> mag;     // magnitude scratch
+};
+
+inline void burst_detector_reset(burst_detector *_q, unsigned long long _index)
+{
+    std::fill(_q->hist.begin(), _q->hist.end(), 0.0f);
+    _q->hist_pos = 0;
+    _q->sum1     = 0.0;
+    _q->sum2     = 0.0;
+    _q->sum2_sq  = 0.0;
+    _q->filled   = 0;
+    _q->index    = _index;
+    burst_edge_search_reset(&_q->onset);
+    burst_edge_search_reset(&_q->end);
+}
+
+inline void burst_detector_init(burst_detector *_q,
+                                unsigned int _window,
+                                float _threshold,
+                                std::ostream *_log)
+{
+    _q->window    = _window;
+    _q->threshold = _threshold;
+    _q->hist.assign(2*_window + 1, 0.0f);
+    _q->log       = _log;
+    _q->mag.resize(4096);
+    _q->edges.clear();
+    burst_tracker_init(&_q->tracker);
+    _q->peak_power = 0.0;
+    burst_detector_reset(_q, 0);
+}
+
+// recompute the running sums from the history to shed rounding drift
+inline void burst_detector_resum(burst_detector *_q)
+{
+    unsigned int L = _q->hist.size();
+    double s1 = 0.0, s2 = 0.0, s2sq = 0.0;
+    for (unsigned int k=0; k<L; k++) {
+        float v = _q->hist[(_q->hist_pos + k) % L];
+        if (k <= _q->window) {
+            s1 += v;
+        } else {
+            s2   += v;
+            s2sq += (double)v*v;
+        }
+    }
+    _q->sum1    = s1;
+    _q->sum2    = s2;
+    _q->sum2_sq = s2sq;
+}
+
+inline void burst_detector_emit(burst_detector *_q, int _type, const burst_edge_search &_s)
+{
+    burst_edge e;
+    e.type  = _type;
+    e.index = _s.peak_index;
+    e.ratio = _s.peak_ratio;
+    _q->edges.push_back(e);
+
+    if (burst_tracker_edge(&_q->tracker, e))
+        _q->tracker.bursts.back().peak_power = _q->peak_power;
+
+    if (_q->log) {
+        *_q->log << (_type == BURST_EDGE_ONSET ? "burst onset: " : "burst end: ")
+                 << e.index << " ratio: " << e.ratio << std::endl;
+    }
+}
+
+// push _n magnitudes
+inline void burst_detector_push(burst_detector *_q, const float *_x, unsigned int _n)
+{
+    unsigned int W = _q->window;
+    unsigned int L = _q->hist.size();
+
+    for (unsigned int i=0; i<_n; i++) {
+        // oldest sample (leaves the earlier window) and the sample moving
+        // from the later window into the earlier one
+        float x_old = _q->hist[_q->hist_pos];
+        unsigned int mid = _q->hist_pos + W + 1;
+        float x_mid = _q->hist[mid < L ? mid : mid - L];
+
+        _q->sum1    += x_mid - x_old;
+        _q->sum2    += _x[i] - x_mid;
+        _q->sum2_sq += (double)_x[i]*_x[i] - (double)x_mid*x_mid;
+        _q->hist[_q->hist_pos] = _x[i];
+        _q->hist_pos = (_q->hist_pos + 1 == L) ? 0 : _q->hist_pos + 1;
+
+        unsigned long long k = _q->index++;
+        if (++_q->filled < L)
+            continue;
+        if ((_q->filled & 0xfffff) == 0)
+            burst_detector_resum(_q);
+
+        double ratio_on  = _q->sum2 / (_q->sum1 > 1e-9 ? _q->sum1 : 1e-9);
+        double ratio_end = _q->sum1 / (_q->sum2 > 1e-9 ? _q->sum2 : 1e-9);
+        unsigned long long start = k - W + 1;
+
+        // peak mean power of the later window while a burst may be open
+        if (_q->tracker.in_burst || _q->onset.searching) {
+            double p = _q->sum2_sq / W;
+            if (p > _q->peak_power)
+                _q->peak_power = p;
+        } else {
+            _q->peak_power = 0.0;
+        }
+
+        if (burst_edge_search_update(&_q->onset, ratio_on, _q->threshold, k, start, W))
+            burst_detector_emit(_q, BURST_EDGE_ONSET, _q->onset);
+        if (burst_edge_search_update(&_q->end, ratio_end, _q->threshold, k, start, W))
+            burst_detector_emit(_q, BURST_EDGE_END, _q->end);
+    }
+}
+// capture_process_func hook: _buf holds interleaved cshort samples
+// starting at byte _offset of the capture stream
+inline void burst_detector_process(void *_ctx,
+                                   const char *_buf,
+                                   size_t _n,
+                                   unsigned long long _offset)
+{
+    burst_detector *q = (burst_detector*)_ctx;
+
+    // a gap in the stream (dropped chunk) invalidates the windows
+    if (_offset / 4 != q->index)
+        burst_detector_reset(q, _offset / 4);
+
+    const short *x = (const short*)_buf;
+    unsigned int num_samples = _n / 4;
+    unsigned int block = q->mag.size();
+    for (unsigned int i=0; i<num_samples; i+=block) {
+        unsigned int n = num_samples - i < block ? num_samples - i : block;
+        burst_magnitude_sc16(x + 2*i, &q->mag[0], n);
+        burst_detector_push(q, &q->mag[0], n);
+    }
+}
+
+#endif // __BURST_DETECTOR_H__
@@ -0,0 +1,116 @@
+/*
+ * capture_sweep.h
+ *
+ * read-size sweep for the /dev/langford capture path
+ *
+ * For each read size in the sweep list the full capture pipeline (reader,
+ * writer ring, output file) runs for a fixed time while every read() is
+ * timed.  The table of achieved throughput and per-read latency jitter
+ * shows which read size keeps up best on the current host.
+ */
+
+#ifndef __CAPTURE_SWEEP_H__
+#define __CAPTURE_SWEEP_H__
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "noctar_capture.h"
+#include "noctar_config.h"
+
+inline double capture_sweep_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// run the sweep, reading from _device and writing to _output; results
+// are printed to stdout and appended to _log (if not NULL)
+inline bool capture_sweep(const capture_config *_cfg,
+                          const char *_device,
+                          const char *_output,
+                          FILE *_log)
+{
+    const char *hdr = "  read size   |  throughput         |  read latency [us]\n"
+                      "  [samples]   |  [MB/s]    [Msps]   |  mean     stddev    max       |  overflows\n";
+    printf("%s", hdr);
+    if (_log) fprintf(_log, "%s", hdr);
+
+    for (unsigned int s=0; s<_cfg->sweep_read_samples.size(); s++) {
+        unsigned int read_samples = _cfg->sweep_read_samples[s];
+        size_t read_bytes = 4*(size_t)read_samples;
+
+        int fd_read = open(_device, O_RDONLY);
+        if (fd_read < 0) {
+            perror(_device);
+            return false;
+        }
+        bool direct = _cfg->aio_depth > 0;
+        int fd_write = capture_open(_output, O_WRONLY | O_CREAT | O_TRUNC,
+                                    S_IRUSR | S_IWUSR | S_IROTH | S_IWOTH, &direct);
+        if (fd_write < 0) {
+            perror(_output);
+            close(fd_read);
+            return false;
+        }
+
+        size_t chunk_bytes = (size_t)_cfg->chunk_kbytes*1024;
+        if (chunk_bytes < read_bytes)
+            chunk_bytes = read_bytes;
+        capture_writer writer;
+        if (!capture_writer_start(&writer, fd_write, chunk_bytes, _cfg->ring_chunks,
+                                  direct, _cfg->aio_depth, _cfg->alignment)) {
+            close(fd_read);
+            close(fd_write);
+            return false;
+        }
+
+        // per-read latency statistics (Welford)
+        unsigned long long num_reads = 0;
+        unsigned long long num_bytes = 0;
+        double mean = 0.0, m2 = 0.0, max = 0.0;
+
+        double t0 = capture_sweep_now();
+        double t_end = t0 + _cfg->sweep_seconds;
+        double t = t0;
+        while (t < t_end) {
+            ssize_t r = capture_writer_read(&writer, fd_read, read_bytes);
+            double t1 = capture_sweep_now();
+            if (r < 0) {
+                perror("read");
+                break;
+            }
+
+            double dt = t1 - t;
+            t = t1;
+            num_reads++;
+            num_bytes += r;
+            double d = dt - mean;
+            mean += d / num_reads;
+            m2   += d * (dt - mean);
+            if (dt > max) max = dt;
+        }
+        double elapsed = t - t0;
+        capture_writer_stop(&writer);
+        close(fd_read);
+        close(fd_write);
+
+        double stddev = num_reads > 1 ? sqrt(m2 / (num_reads - 1)) : 0.0;
+        char line[256];
+        snprintf(line, sizeof(line), "  %-11u |  %-9.2f %-8.3f |  %-8.2f %-9.2f %-9.2f |  %llu\n",
+                 read_samples,
+                 num_bytes / elapsed * 1e-6,
+                 num_bytes / 4 / elapsed * 1e-6,
+                 mean * 1e6, stddev * 1e6, max * 1e6,
+                 writer.overflows);
+        printf("%s", line);
+        if (_log) fprintf(_log, "%s", line);
+    }
+    return true;
+}
+
+#endif // __CAPTURE_SWEEP_H__
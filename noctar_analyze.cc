@@ -0,0 +1,451 @@
+/*
+ * noctar_analyze.cc
+ *
+ * offline double-sliding-window analysis of noctar_samples captures;
+ * C++ companion of double_window.m
+ *
+ * The capture (interleaved cshort I/Q) is memory-mapped and split into
+ * one contiguous range of window positions per thread.  Each thread
+ * computes magnitudes block by block with the SIMD kernels from
+ * burst_detector.h, forms prefix sums and evaluates the ratio
+ *
+ *     sum(|y[i+W+1 .. i+2W]|) / sum(|y[i .. i+W]|)
+ *
+ * for every position, exactly as double_window.m does, but over the
+ * whole file (or a -s/-e range) instead of a fixed 2M-sample slice.
+ *
+ * With a ratio threshold (-t) it instead finds every burst: each thread
+ * runs the streaming burst_detector over its share of the file (with
+ * enough overlap to warm up its windows), the onset/end edges of all
+ * threads are merged in order and paired into bursts, and a per-burst
+ * table is printed and optionally appended to the capture log.
+ *
+ * A capture container (noctar_container.h) is recognized by its header:
+ * only its body is analyzed, -s/-e are raw Noctar sample indices that
+ * are looked up through the container's index, and results are reported
+ * on the raw grid as well.  -b picks the range from the index instead,
+ * around one tx burst, and -I lists the index.  A compressed container
+ * is decoded first, but only the blocks overlapping the range.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+
+#include "burst_detector.h"
+#include "noctar_container.h"
+
+// window positions handled per block
+#define ANALYZE_BLOCK (1<<20)
+
+struct analyze_arg_struct {
+    const short *samples;       // whole capture
+    unsigned long long begin;   // first window position
+    unsigned long long end;     // one past the last window position
+    unsigned int window;
+
+    // result
+    double max_ratio;
+    unsigned long long max_index;   // window position of max_ratio
+};
+
+struct edges_arg_struct {
+    const short *samples;       // whole capture
+    unsigned long long first;   // first sample fed to the detector
+    unsigned long long last;    // one past the last sample fed
+    unsigned long long begin;   // edges owned by this thread: [begin,end)
+    unsigned long long end;
+    unsigned int window;
+    float threshold;
+
+    // result
+    std::vector<burst_edge> edges;
+};
+
+void *analyze_range(void *args);
+void *find_edges(void *args);
+double burst_peak_power(const short *samples, unsigned long long start,
+                        unsigned long long end, unsigned int window);
+
+void usage() {
+    printf("noctar_analyze -- find bursts in a noctar_samples capture\n");
+    printf("\n");
+    printf("  u,h   : usage/help\n");
+    printf("  i     : input capture file, default: ./noctar_samples\n");
+    printf("  W     : window size [samples], default: 1000\n");
+    printf("  s     : first sample to analyze, default: 0\n");
+    printf("  e     : last sample to analyze (0: end of file), default: 0\n");
+    printf("  j     : number of threads, default: number of cpus\n");
+    printf("  t     : find all bursts with this onset/end ratio threshold\n");
+    printf("  l     : append the burst table to this log, e.g. ./noctar_samples.log\n");
+    printf("  b     : container only: analyze around this tx burst\n");
+    printf("  m     : raw samples of margin around the -b burst, default: 100000\n");
+    printf("  I     : container only: list the index and exit\n");
+}
+
+// print the header and index of a capture container
+void container_list(const noctar_container *c)
+{
+    const noctar_container_header *h = c->header;
+    printf("container   :   version %u, %llu samples at %.0f samples/s, decimation %u\n",
+            h->version, c->body_samples, h->sample_rate, h->decimation);
+    printf("noctar      :   %.0f samples/s, center %.0f Hz, channel offset %.0f Hz, delay %.1f\n",
+            h->noctar_rate, h->noctar_center, h->channel_offset, h->channel_delay);
+    printf("tx          :   %.0f Hz, %.0f samples/s, gain %.1f dB, uhd gain %.1f dB\n",
+            h->tx_frequency, h->tx_rate, h->tx_gain_dB, h->uhd_gain);
+    printf("raw samples :   %llu read, %llu dropped\n",
+            (unsigned long long)h->raw_samples, (unsigned long long)h->dropped_samples);
+    if (c->packed != NULL)
+        printf("packed      :   %llu bytes, ratio %.3f\n", c->packed_bytes,
+                c->packed_bytes > 0 ? 4.0*(h->raw_samples - h->dropped_samples) / c->packed_bytes : 0.0);
+    for (unsigned long long i=0; i<c->index_count; i++) {
+        const noctar_index_entry &e = c->index[i];
+        printf("%-12s:   id %u sample %llu aux %llu value %g flags %u\n", noctar_index_name(e.type), e.id,
+                (unsigned long long)e.sample, (unsigned long long)e.aux, e.value, e.flags);
+    }
+}
+
+// raw Noctar sample of analyzed sample _k; a packed container is
+// analyzed as the decoded raw range starting at _base
+unsigned long long container_raw_sample(const noctar_container *c,
+                                        unsigned long long base,
+                                        unsigned long long k)
+{
+    return c->packed != NULL ? base + k : noctar_container_raw_sample(c, k);
+}
+
+int main (int argc, char **argv)
+{
+    const char *filename = "./noctar_samples";
+    unsigned int window = 1000;
+    unsigned long long first_sample = 0;
+    unsigned long long last_sample  = 0;
+    unsigned int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    float threshold = 0.0f;             // 0: single max-ratio search
+    const char *log_filename = NULL;
+    int tx_burst = -1;                  // -1: use -s/-e
+    unsigned long long margin = 100000;
+    bool list_index = false;
+
+    int d;
+    while ((d = getopt(argc,argv,"uhi:W:s:e:j:t:l:b:m:I")) != EOF) {
+        switch (d) {
+        case 'u':
+        case 'h':   usage();                            return 0;
+        case 'i':   filename     = optarg;              break;
+        case 'W':   window       = atoi(optarg);        break;
+        case 's':   first_sample = strtoull(optarg,NULL,0); break;
+        case 'e':   last_sample  = strtoull(optarg,NULL,0); break;
+        case 'j':   num_threads  = atoi(optarg);        break;
+        case 't':   threshold    = atof(optarg);        break;
+        case 'l':   log_filename = optarg;              break;
+        case 'b':   tx_burst     = atoi(optarg);        break;
+        case 'm':   margin       = strtoull(optarg,NULL,0); break;
+        case 'I':   list_index   = true;                break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (window == 0 || num_threads == 0) {
+        fprintf(stderr,"error: %s, window size and thread count must be positive\n", argv[0]);
+        exit(1);
+    }
+
+    // map capture
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        exit(1);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    // a container: analyze its body, with the range given on the raw
+    // grid (or by a tx burst) and looked up through its index
+    const short *samples = (const short*)map;
+    unsigned long long num_samples = st.st_size / 4;
+    noctar_container container;
+    std::vector<short> unpacked;        // decoded range of a packed container
+    unsigned long long raw_base = 0;
+    bool is_container = noctar_container_detect(map, st.st_size);
+    if (is_container) {
+        if (!noctar_container_parse(&container, map, st.st_size))
+            exit(1);
+        if (list_index) {
+            container_list(&container);
+            return 0;
+        }
+        if (tx_burst >= 0) {
+            const noctar_index_entry *b = noctar_container_find(&container, NOCTAR_INDEX_TX_BURST, tx_burst);
+            if (b == NULL) {
+                fprintf(stderr,"error: %s, no tx burst %d in the index\n", argv[0], tx_burst);
+                exit(1);
+            }
+            first_sample = b->sample > margin ? b->sample - margin : 0;
+            last_sample  = b->aux + margin;
+        }
+        if (container.packed != NULL) {
+            // decode just the raw range (zeros where chunks were dropped)
+            if (last_sample == 0 || last_sample > container.header->raw_samples)
+                last_sample = container.header->raw_samples;
+            if (last_sample == 0) {
+                std::vector<noctar_index_entry> blocks;
+                noctar_container_blocks(&container, &blocks);
+                if (!blocks.empty())
+                    last_sample = blocks.back().sample + (unsigned long long)blocks.back().value;
+            }
+            if (last_sample <= first_sample ||
+                !noctar_container_unpack(&container, first_sample, last_sample, &unpacked))
+                exit(1);
+            raw_base     = first_sample;
+            samples      = &unpacked[0];
+            num_samples  = unpacked.size() / 2;
+            first_sample = 0;
+            last_sample  = num_samples;
+        } else {
+            samples     = container.body;
+            num_samples = container.body_samples;
+            unsigned long long body;
+            first_sample = noctar_container_body_sample(&container, first_sample, &body) ? body : 0;
+            last_sample  = last_sample > 0 && noctar_container_body_sample(&container, last_sample, &body) ? body : 0;
+        }
+    } else if (list_index || tx_burst >= 0) {
+        fprintf(stderr,"error: %s, -b and -I need a capture container\n", argv[0]);
+        exit(1);
+    }
+
+    if (last_sample == 0 || last_sample > num_samples)
+        last_sample = num_samples;
+    if (last_sample <= first_sample || last_sample - first_sample < 2*window + 1) {
+        fprintf(stderr,"error: %s, range holds fewer than 2*W+1 samples\n", argv[0]);
+        exit(1);
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    if (threshold > 0.0f) {
+        // split samples evenly across threads; each detector starts early
+        // enough to settle and runs on far enough to finish its searches
+        unsigned long long num = last_sample - first_sample;
+        if (num_threads > num / (8*window) + 1)
+            num_threads = num / (8*window) + 1;
+        unsigned long long warmup = 4*(unsigned long long)window + 2;
+        unsigned long long tail   = 3*(unsigned long long)window;
+
+        std::vector<edges_arg_struct> eargs(num_threads);
+        std::vector<pthread_t> threads(num_threads);
+        std::vector<bool> started(num_threads, false);
+        for (unsigned int t=0; t<num_threads; t++) {
+            edges_arg_struct &a = eargs[t];
+            a.samples   = samples;
+            a.begin     = first_sample + num * t / num_threads;
+            a.end       = first_sample + num * (t+1) / num_threads;
+            a.first     = a.begin > first_sample + warmup ? a.begin - warmup : first_sample;
+            a.last      = a.end + tail < last_sample ? a.end + tail : last_sample;
+            a.window    = window;
+            a.threshold = threshold;
+            started[t] = pthread_create(&threads[t], NULL, find_edges, (void*)&a) == 0;
+        }
+
+        // merge edges in sample order, dropping duplicates found by two
+        // threads near a boundary; a range whose thread could not be
+        // created is searched here
+        std::vector<burst_edge> edges;
+        for (unsigned int t=0; t<num_threads; t++) {
+            if (started[t]) {
+                pthread_join(threads[t], NULL);
+            } else {
+                fprintf(stderr,"warning: %s, searching samples %llu..%llu inline\n",
+                        argv[0], eargs[t].begin, eargs[t].end);
+                find_edges((void*)&eargs[t]);
+            }
+            edges.insert(edges.end(), eargs[t].edges.begin(), eargs[t].edges.end());
+        }
+        std::stable_sort(edges.begin(), edges.end(), burst_edge_less);
+
+        burst_tracker tracker;
+        burst_tracker_init(&tracker);
+        unsigned long long last_index[2] = {0, 0};
+        bool seen[2] = {false, false};
+        for (unsigned int i=0; i<edges.size(); i++) {
+            const burst_edge &e = edges[i];
+            if (seen[e.type] && e.index - last_index[e.type] <= window)
+                continue;
+            seen[e.type] = true;
+            last_index[e.type] = e.index;
+            if (burst_tracker_edge(&tracker, e)) {
+                burst_record &b = tracker.bursts.back();
+                b.peak_power = burst_peak_power(samples, b.start, b.end, window);
+            }
+        }
+
+        // report on the raw grid; peak powers were taken on the body
+        if (is_container) {
+            for (unsigned int i=0; i<tracker.bursts.size(); i++) {
+                tracker.bursts[i].start = container_raw_sample(&container, raw_base, tracker.bursts[i].start);
+                tracker.bursts[i].end   = container_raw_sample(&container, raw_base, tracker.bursts[i].end);
+            }
+            tracker.current.start = container_raw_sample(&container, raw_base, tracker.current.start);
+            printf("raw samples :   %llu .. %llu\n", container_raw_sample(&container, raw_base, first_sample),
+                    container_raw_sample(&container, raw_base, last_sample));
+        }
+        printf("samples     :   %llu .. %llu\n", first_sample, last_sample);
+        printf("window      :   %u\n", window);
+        printf("threshold   :   %f\n", threshold);
+        printf("threads     :   %u\n", num_threads);
+        if (tracker.in_burst)
+            printf("note        :   burst starting at %llu has no end in range\n", tracker.current.start);
+        burst_write_table(std::cout, tracker.bursts);
+
+        if (log_filename != NULL) {
+            std::ofstream log_file(log_filename, std::ios::app);
+            log_file << "burst detector window: " << window << " threshold: " << threshold << std::endl;
+            burst_write_table(log_file, tracker.bursts);
+        }
+
+        munmap(map, st.st_size);
+        close(fd);
+        return 0;
+    }
+
+    // split window positions evenly across threads
+    unsigned long long num_positions = last_sample - first_sample - 2*window;
+    if (num_threads > num_positions)
+        num_threads = num_positions;
+    std::vector<analyze_arg_struct> args(num_threads);
+    std::vector<pthread_t> threads(num_threads);
+    std::vector<bool> started(num_threads, false);
+    for (unsigned int t=0; t<num_threads; t++) {
+        args[t].samples = samples;
+        args[t].begin   = first_sample + num_positions * t / num_threads;
+        args[t].end     = first_sample + num_positions * (t+1) / num_threads;
+        args[t].window  = window;
+        started[t] = pthread_create(&threads[t], NULL, analyze_range, (void*)&args[t]) == 0;
+    }
+
+    // analyze any range whose thread could not be created here
+    double max_ratio = -1.0;
+    unsigned long long max_index = 0;
+    for (unsigned int t=0; t<num_threads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        } else {
+            fprintf(stderr,"warning: %s, analyzing window positions %llu..%llu inline\n",
+                    argv[0], args[t].begin, args[t].end);
+            analyze_range((void*)&args[t]);
+        }
+        if (args[t].max_ratio > max_ratio) {
+            max_ratio = args[t].max_ratio;
+            max_index = args[t].max_index;
+        }
+    }
+
+    // onset is the first sample of the later window (0-based)
+    printf("samples     :   %llu .. %llu\n", first_sample, last_sample);
+    printf("window      :   %u\n", window);
+    printf("threads     :   %u\n", num_threads);
+    printf("max ratio   :   %12.6f\n", max_ratio);
+    printf("rx start    :   %llu\n", max_index + window + 1);
+    if (is_container)
+        printf("raw start   :   %llu\n", container_raw_sample(&container, raw_base, max_index + window + 1));
+
+    munmap(map, st.st_size);
+    close(fd);
+    return 0;
+}
+
+void *analyze_range(void *args)
+{
+    analyze_arg_struct *a = (analyze_arg_struct*)args;
+    unsigned int W = a->window;
+
+    // magnitudes and prefix sums for one block plus the 2W+1 samples its
+    // last window position reaches into
+    std::vector<float>  mag(ANALYZE_BLOCK + 2*W + 1);
+    std::vector<double> psum(ANALYZE_BLOCK + 2*W + 2);
+
+    a->max_ratio = -1.0;
+    a->max_index = a->begin;
+
+    for (unsigned long long i0=a->begin; i0<a->end; i0+=ANALYZE_BLOCK) {
+        unsigned int n = (a->end - i0 < ANALYZE_BLOCK) ? (unsigned int)(a->end - i0) : ANALYZE_BLOCK;
+        unsigned int m = n + 2*W;
+
+        burst_magnitude_sc16(a->samples + 2*i0, &mag[0], m);
+
+        psum[0] = 0.0;
+        for (unsigned int k=0; k<m; k++)
+            psum[k+1] = psum[k] + mag[k];
+
+        for (unsigned int j=0; j<n; j++) {
+            double w1 = psum[j+W+1] - psum[j];
+            double w2 = psum[j+2*W+1] - psum[j+W+1];
+            double ratio = w2 / (w1 > 1e-9 ? w1 : 1e-9);
+            if (ratio > a->max_ratio) {
+                a->max_ratio = ratio;
+                a->max_index = i0 + j;
+            }
+        }
+    }
+    return NULL;
+}
+
+void *find_edges(void *args)
+{
+    edges_arg_struct *a = (edges_arg_struct*)args;
+
+    burst_detector q;
+    burst_detector_init(&q, a->window, a->threshold, NULL);
+    burst_detector_reset(&q, a->first);
+
+    const unsigned long long block = ANALYZE_BLOCK;
+    for (unsigned long long i=a->first; i<a->last; i+=block) {
+        unsigned long long n = a->last - i < block ? a->last - i : block;
+        burst_detector_process(&q, (const char*)(a->samples + 2*i), 4*n, 4*i);
+    }
+
+    for (unsigned int i=0; i<q.edges.size(); i++) {
+        if (q.edges[i].index >= a->begin && q.edges[i].index < a->end)
+            a->edges.push_back(q.edges[i]);
+    }
+    return NULL;
+}
+
+// peak W-window mean |y|^2 within [start,end)
+double burst_peak_power(const short *samples,
+                        unsigned long long start,
+                        unsigned long long end,
+                        unsigned int window)
+{
+    if (end - start < window)
+        window = end - start;
+    if (window == 0)
+        return 0.0;
+
+    unsigned long long sum = 0, peak = 0;
+    for (unsigned long long k=start; k<end; k++) {
+        long long re = samples[2*k], im = samples[2*k+1];
+        sum += re*re + im*im;
+        if (k >= start + window) {
+            long long re0 = samples[2*(k-window)], im0 = samples[2*(k-window)+1];
+            sum -= re0*re0 + im0*im0;
+        }
+        if (k + 1 >= start + window && sum > peak)
+            peak = sum;
+    }
+    return (double)peak / window;
+}
@@ -0,0 +1,141 @@
+/*
+ * noctar_arena.h
+ *
+ * locked, pre-faulted memory arenas and page-fault accounting
+ *
+ * Capture rings and tx waveforms are carved from arenas set up before
+ * anything runs at SCHED_FIFO.  An arena of at least one huge page is
+ * first tried on explicit huge pages (MAP_HUGETLB, from the hugetlbfs
+ * pool); otherwise it is mapped on normal pages with transparent huge
+ * pages requested through madvise().  Either way the range is mlock()ed
+ * and every page is written once, so the receive loop and the transmit
+ * worker never take the first-touch fault (a read fault would only map
+ * the shared zero page).  Neither huge pages nor the lock are required:
+ * the arena records what it got, and the caller reports it.
+ *
+ * noctar_faults samples the minor/major fault counters of the process
+ * or of the calling thread, so a run can log how many faults it took.
+ */
+
+#ifndef __NOCTAR_ARENA_H__
+#define __NOCTAR_ARENA_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+// size of an explicit (hugetlbfs) huge page on x86-64
+#define NOCTAR_HUGE_PAGE (2ul << 20)
+
+struct noctar_arena {
+    char *base;                 // aligned start of the usable range
+    size_t bytes;               // usable bytes (rounded up to a page)
+    void *map;                  // the mapping itself
+    size_t map_bytes;
+    bool huge;                  // explicit huge pages (else THP advised)
+    bool locked;                // mlock() succeeded
+};
+
+// round _n up to a multiple of _align (_align must be a power of two)
+inline size_t capture_align_up(size_t _n, size_t _align)
+{
+    return (_n + _align - 1) & ~(_align - 1);
+}
+
+// map, lock and pre-fault an arena of at least _bytes starting on an
+// _align boundary (0: page size, otherwise a power of two)
+inline bool noctar_arena_create(noctar_arena *_a, size_t _bytes, size_t _align = 0)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (_align < page)
+        _align = page;
+
+    _a->base      = NULL;
+    _a->bytes     = 0;
+    _a->map       = NULL;
+    _a->map_bytes = 0;
+    _a->huge      = false;
+    _a->locked    = false;
+    if (_bytes == 0) {
+        fprintf(stderr,"error: noctar_arena_create(), empty arena\n");
+        return false;
+    }
+
+    // explicit huge pages: the mapping is huge-page aligned already
+    if (_bytes >= NOCTAR_HUGE_PAGE && _align <= NOCTAR_HUGE_PAGE) {
+        size_t len = capture_align_up(_bytes, NOCTAR_HUGE_PAGE);
+        void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            _a->map = _a->base = (char*)p;
+            _a->map_bytes = _a->bytes = len;
+            _a->huge = true;
+        }
+    }
+
+    // normal pages: over-allocate by the alignment and trim both ends
+    if (!_a->huge) {
+        size_t len   = capture_align_up(_bytes, page);
+        size_t extra = _align > page ? _align : 0;
+        void *p = mmap(NULL, len + extra, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("noctar_arena_create(), mmap");
+            return false;
+        }
+        char *base = (char*)capture_align_up((size_t)p, _align);
+        if (base > (char*)p)
+            munmap(p, base - (char*)p);
+        if ((char*)p + extra > base)
+            munmap(base + len, (char*)p + extra - base);
+        _a->map = _a->base = base;
+        _a->map_bytes = _a->bytes = len;
+#ifdef MADV_HUGEPAGE
+        madvise(base, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    // lock, then write every page so each is private and resident
+    _a->locked = mlock(_a->base, _a->bytes) == 0;
+    for (size_t i=0; i<_a->bytes; i+=page)
+        ((volatile char*)_a->base)[i] = 0;
+    return true;
+}
+
+inline void noctar_arena_destroy(noctar_arena *_a)
+{
+    if (_a->map != NULL)
+        munmap(_a->map, _a->map_bytes);
+    _a->map  = NULL;
+    _a->base = NULL;
+}
+
+// page-fault counters
+struct noctar_faults {
+    long minor;
+    long major;
+};
+
+// counters of the whole process (_thread false) or the calling thread
+inline noctar_faults noctar_faults_now(bool _thread)
+{
+    noctar_faults f = {0, 0};
+    struct rusage ru;
+    if (getrusage(_thread ? RUSAGE_THREAD : RUSAGE_SELF, &ru) == 0) {
+        f.minor = ru.ru_minflt;
+        f.major = ru.ru_majflt;
+    }
+    return f;
+}
+
+// faults taken between _a and _b
+inline noctar_faults noctar_faults_since(const noctar_faults &_a, const noctar_faults &_b)
+{
+    noctar_faults d = {_b.minor - _a.minor, _b.major - _a.major};
+    return d;
+}
+
+#endif // __NOCTAR_ARENA_H__
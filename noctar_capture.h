@@ -0,0 +1,577 @@
+/*
+ * noctar_capture.h
+ *
+ * capture buffer pool for the /dev/langford reader
+ *
+ * The pool is one locked, pre-faulted arena (huge pages when available,
+ * see noctar_arena.h) split into fixed-size chunks.  The receive loop
+ * fills a chunk with many small read() calls and only hands it to the
+ * writer once it is full, so the disk sees a few multi-megabyte writes
+ * instead of one write per read.
+ *
+ * The chunks form a lock-free single-producer/single-consumer ring
+ * between the Noctar reader and a dedicated writer thread, so a disk
+ * stall never blocks acquisition.  When the ring is full the reader
+ * drops the chunk it just filled and counts an overflow instead of
+ * waiting for the disk.
+ *
+ * Optionally the writer bypasses the page cache: the file is opened with
+ * O_DIRECT and chunks are submitted through Linux native AIO (raw
+ * io_submit/io_getevents syscalls, no libaio needed) with several writes
+ * in flight.  Chunks stay queued until their write completes.
+ *
+ * A processing hook (e.g. a burst detector) can be attached to the
+ * writer; it sees every chunk before it is written, together with the
+ * chunk's byte offset in the capture stream (dropped chunks included),
+ * so it runs off the acquisition thread but keeps sample alignment.
+ *
+ * A transform hook (e.g. a channelizer) can replace what is written: the
+ * writer hands it each chunk after the processing hook and writes the
+ * bytes it returns instead.  Transformed output has no fixed size, so a
+ * transform needs the buffered (non-O_DIRECT) writer.
+ *
+ * The capture can start past a file header
+ * (capture_writer_set_file_offset).  Untransformed, the writer also
+ * records where in the file each run of contiguous stream bytes begins,
+ * i.e. where the chunks dropped on a full ring are missing, so a reader
+ * can map stream offsets to file offsets.
+ */
+
+#ifndef __NOCTAR_CAPTURE_H__
+#define __NOCTAR_CAPTURE_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include <vector>
+
+#include "noctar_arena.h"
+
+struct capture_pool {
+    noctar_arena arena;
+    char *base;                 // start of the pool (arena.base)
+    size_t map_bytes;           // total size of the pool
+    size_t chunk_bytes;         // size of each chunk (page multiple)
+    unsigned int num_chunks;    // number of chunks in the pool
+};
+
+// O_DIRECT transfer sizes and file offsets must be multiples of this
+#define CAPTURE_DIRECT_ALIGN 4096
+
+// map a pool of _num_chunks chunks of (at least) _chunk_bytes each,
+// every chunk starting on an _align boundary (0: page size, otherwise a
+// power of two); pages are locked and faulted in up front so the
+// receive loop does not fault
+inline bool capture_pool_create(capture_pool *_pool,
+                                size_t _chunk_bytes,
+                                unsigned int _num_chunks,
+                                size_t _align = 0)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (_align < page)
+        _align = page;
+
+    _pool->chunk_bytes = capture_align_up(_chunk_bytes, _align);
+    _pool->num_chunks  = _num_chunks;
+    _pool->map_bytes   = _pool->chunk_bytes * _num_chunks;
+    _pool->base        = NULL;
+
+    if (!noctar_arena_create(&_pool->arena, _pool->map_bytes, _align))
+        return false;
+    _pool->base = _pool->arena.base;
+    return true;
+}
+
+inline void capture_pool_destroy(capture_pool *_pool)
+{
+    if (_pool->base != NULL)
+        noctar_arena_destroy(&_pool->arena);
+    _pool->base = NULL;
+}
+
+// pointer to the start of chunk _i
+inline char *capture_pool_chunk(const capture_pool *_pool, unsigned int _i)
+{
+    return _pool->base + (size_t)_i * _pool->chunk_bytes;
+}
+
+// write _n bytes from _buf to _fd, retrying on short writes
+inline bool capture_write_all(int _fd, const char *_buf, size_t _n)
+{
+    while (_n > 0) {
+        ssize_t r = write(_fd, _buf, _n);
+        if (r < 0) {
+            perror("capture_write_all(), write");
+            return false;
+        }
+        _buf += r;
+        _n   -= r;
+    }
+    return true;
+}
+
+// open a capture output file; with _direct set, O_DIRECT is tried first
+// and *_direct is cleared if the filesystem refuses it
+inline int capture_open(const char *_path, int _flags, mode_t _mode, bool *_direct)
+{
+    if (*_direct) {
+        int fd = open(_path, _flags | O_DIRECT, _mode);
+        if (fd >= 0)
+            return fd;
+        fprintf(stderr,"warning: %s does not support O_DIRECT (%s), using buffered writes\n",
+                _path, strerror(errno));
+        *_direct = false;
+    }
+    return open(_path, _flags, _mode);
+}
+
+// thin wrappers around the native AIO syscalls
+inline int capture_io_setup(unsigned int _nr, aio_context_t *_ctx)
+{
+    return syscall(SYS_io_setup, _nr, _ctx);
+}
+
+inline int capture_io_destroy(aio_context_t _ctx)
+{
+    return syscall(SYS_io_destroy, _ctx);
+}
+
+inline int capture_io_submit(aio_context_t _ctx, long _n, struct iocb **_iocbpp)
+{
+    return syscall(SYS_io_submit, _ctx, _n, _iocbpp);
+}
+
+inline int capture_io_getevents(aio_context_t _ctx, long _min, long _max,
+                                struct io_event *_events, struct timespec *_timeout)
+{
+    return syscall(SYS_io_getevents, _ctx, _min, _max, _events, _timeout);
+}
+
+// hook run by the writer thread on each chunk before it is written;
+// _offset is the byte offset of _buf in the capture stream
+typedef void (*capture_process_func)(void *_ctx,
+                                     const char *_buf,
+                                     size_t _n,
+                                     unsigned long long _offset);
+
+// hook run by the writer thread on each chunk after the processing
+// hook; returns the bytes to write instead of the chunk (*_out_n of
+// them, valid until the next call)
+typedef const char *(*capture_transform_func)(void *_ctx,
+                                              const char *_buf,
+                                              size_t _n,
+                                              unsigned long long _offset,
+                                              size_t *_out_n);
+
+// a run of contiguous capture stream bytes in the file
+struct capture_run {
+    unsigned long long stream_offset;   // stream byte offset of the run
+    unsigned long long file_offset;     // its offset from the capture start
+};
+
+// single-producer/single-consumer ring of capture chunks drained to a
+// file descriptor by a writer thread
+struct capture_writer {
+    capture_pool pool;
+    size_t *fill;               // valid bytes in each chunk
+    unsigned long long *offset; // stream offset of each chunk
+    int fd;                     // destination file
+
+    // ring indices (free-running); only the reader stores head, only
+    // the writer stores tail
+    unsigned int head;          // next chunk the reader publishes
+    unsigned int tail;          // next chunk the writer retires
+    int closed;                 // set by the reader when capture ends
+
+    // reader side: chunk being filled
+    char *cur;
+    size_t cur_fill;
+    unsigned long long read_bytes;  // bytes read so far, dropped included
+
+    // optional per-chunk processing on the writer thread
+    capture_process_func process;
+    void *process_ctx;
+
+    // optional transform of what is written (buffered writer only)
+    capture_transform_func transform;
+    void *transform_ctx;
+
+    // direct i/o (writer side)
+    bool direct;                // fd was opened with O_DIRECT
+    unsigned int aio_depth;     // writes in flight (0: synchronous)
+    aio_context_t aio_ctx;
+    struct iocb *iocbs;         // one per chunk
+    unsigned char *done;        // per-chunk completion flag
+    unsigned long long file_offset;
+
+    // file layout (writer side)
+    unsigned long long file_base;       // file offset of the first capture byte
+    unsigned long long next_stream;     // stream offset the next chunk continues
+    std::vector<capture_run> runs;      // contiguous runs (untransformed only)
+
+    // counters
+    unsigned long long chunks_written;  // chunks drained by the writer
+    unsigned long long bytes_written;   // bytes drained by the writer
+    unsigned long long overflows;       // chunks dropped on a full ring
+    unsigned long long dropped_bytes;   // bytes dropped on a full ring
+    unsigned int max_depth;             // high-water mark of queued chunks
+    unsigned int max_in_flight;         // high-water mark of AIO writes
+    int write_errors;                   // failed writes
+
+    pthread_t thread;
+};
+
+inline void capture_writer_idle()
+{
+    struct timespec ts = {0, 200000};
+    nanosleep(&ts, NULL);
+}
+
+// start a new run if chunk _i does not continue the previous one; _pos is
+// where the chunk lands, relative to the capture start
+inline void capture_writer_note_run(capture_writer *_w, unsigned int _i, unsigned long long _pos)
+{
+    if (_w->transform != NULL)
+        return;
+    if (_w->runs.empty() || _w->offset[_i] != _w->next_stream) {
+        capture_run r = {_w->offset[_i], _pos};
+        _w->runs.push_back(r);
+    }
+    _w->next_stream = _w->offset[_i] + _w->fill[_i];
+}
+
+// buffered (or synchronous direct) writer: one write() per chunk
+inline void capture_writer_run_sync(capture_writer *_w)
+{
+    unsigned int n = _w->pool.num_chunks;
+
+    while (true) {
+        unsigned int head = __atomic_load_n(&_w->head, __ATOMIC_ACQUIRE);
+        if (_w->tail == head) {
+            // nothing queued; the reader only sets closed after its
+            // final publish, so re-check head once it is set
+            if (__atomic_load_n(&_w->closed, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&_w->head, __ATOMIC_ACQUIRE) == _w->tail)
+                break;
+            capture_writer_idle();
+            continue;
+        }
+
+        unsigned int i = _w->tail % n;
+        if (_w->process)
+            _w->process(_w->process_ctx, capture_pool_chunk(&_w->pool, i), _w->fill[i], _w->offset[i]);
+        capture_writer_note_run(_w, i, _w->bytes_written);
+        const char *buf = capture_pool_chunk(&_w->pool, i);
+        size_t len = _w->fill[i];
+        size_t bytes = len;
+        if (_w->transform) {
+            buf = _w->transform(_w->transform_ctx, buf, len, _w->offset[i], &len);
+            bytes = len;
+        } else if (_w->direct) {
+            len = capture_align_up(len, CAPTURE_DIRECT_ALIGN);
+        }
+        if (len > 0 && !capture_write_all(_w->fd, buf, len))
+            _w->write_errors++;
+        _w->chunks_written++;
+        _w->bytes_written += bytes;
+
+        __atomic_store_n(&_w->tail, _w->tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// direct writer: keep up to aio_depth chunk writes in flight and retire
+// chunks back to the reader in order as they complete
+inline void capture_writer_run_aio(capture_writer *_w)
+{
+    unsigned int n = _w->pool.num_chunks;
+    unsigned int submitted = _w->tail;  // next chunk to submit
+    unsigned int in_flight = 0;
+    struct io_event events[64];
+
+    while (true) {
+        unsigned int head = __atomic_load_n(&_w->head, __ATOMIC_ACQUIRE);
+
+        // submit queued chunks while there is room in flight
+        while (submitted != head && in_flight < _w->aio_depth) {
+            unsigned int i = submitted % n;
+            if (_w->process)
+                _w->process(_w->process_ctx, capture_pool_chunk(&_w->pool, i), _w->fill[i], _w->offset[i]);
+            capture_writer_note_run(_w, i, _w->file_offset - _w->file_base);
+            struct iocb *cb = &_w->iocbs[i];
+            memset(cb, 0, sizeof(*cb));
+            cb->aio_data       = i;
+            cb->aio_lio_opcode = IOCB_CMD_PWRITE;
+            cb->aio_fildes     = _w->fd;
+            cb->aio_buf        = (unsigned long)capture_pool_chunk(&_w->pool, i);
+            cb->aio_nbytes     = capture_align_up(_w->fill[i], CAPTURE_DIRECT_ALIGN);
+            cb->aio_offset     = _w->file_offset;
+
+            if (capture_io_submit(_w->aio_ctx, 1, &cb) != 1) {
+                perror("capture_writer_run_aio(), io_submit");
+                _w->write_errors++;
+                _w->done[i] = 1;
+            } else {
+                in_flight++;
+            }
+            _w->file_offset += _w->fill[i];
+            submitted++;
+        }
+        if (in_flight > _w->max_in_flight)
+            _w->max_in_flight = in_flight;
+
+        // reap completions; block briefly only when there is nothing to submit
+        if (in_flight > 0) {
+            struct timespec timeout = {0, 200000};
+            long max = in_flight < 64 ? in_flight : 64;
+            long min = (submitted == head || in_flight == _w->aio_depth) ? 1 : 0;
+            int r = capture_io_getevents(_w->aio_ctx, min, max, events, &timeout);
+            for (int k=0; k<r; k++) {
+                unsigned int i = (unsigned int)events[k].data;
+                if ((long long)events[k].res < (long long)_w->fill[i])
+                    _w->write_errors++;
+                _w->done[i] = 1;
+                in_flight--;
+            }
+        }
+
+        // retire completed chunks in ring order
+        while (_w->tail != submitted && _w->done[_w->tail % n]) {
+            unsigned int i = _w->tail % n;
+            _w->done[i] = 0;
+            _w->chunks_written++;
+            _w->bytes_written += _w->fill[i];
+            __atomic_store_n(&_w->tail, _w->tail + 1, __ATOMIC_RELEASE);
+        }
+
+        if (_w->tail == head && in_flight == 0) {
+            if (__atomic_load_n(&_w->closed, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&_w->head, __ATOMIC_ACQUIRE) == _w->tail)
+                break;
+            capture_writer_idle();
+        }
+    }
+}
+
+inline void *capture_writer_thread(void *_arg)
+{
+    capture_writer *w = (capture_writer*)_arg;
+    if (w->aio_depth > 0)
+        capture_writer_run_aio(w);
+    else
+        capture_writer_run_sync(w);
+    return NULL;
+}
+
+// allocate the ring and start the writer thread on _fd; with _direct set
+// (fd opened with O_DIRECT) up to _aio_depth writes are kept in flight
+inline bool capture_writer_start(capture_writer *_w,
+                                 int _fd,
+                                 size_t _chunk_bytes,
+                                 unsigned int _num_chunks,
+                                 bool _direct = false,
+                                 unsigned int _aio_depth = 0,
+                                 size_t _align = 0)
+{
+    if (_num_chunks < 2)
+        _num_chunks = 2;
+    if (_direct)
+        _chunk_bytes = capture_align_up(_chunk_bytes, CAPTURE_DIRECT_ALIGN);
+    if (!capture_pool_create(&_w->pool, _chunk_bytes, _num_chunks, _align))
+        return false;
+
+    _w->fill   = new size_t[_num_chunks]();
+    _w->offset = new unsigned long long[_num_chunks]();
+    _w->fd   = _fd;
+    _w->head = 0;
+    _w->tail = 0;
+    _w->closed = 0;
+    _w->cur      = capture_pool_chunk(&_w->pool, 0);
+    _w->cur_fill = 0;
+    _w->read_bytes  = 0;
+    _w->process     = NULL;
+    _w->process_ctx = NULL;
+    _w->transform     = NULL;
+    _w->transform_ctx = NULL;
+    _w->chunks_written = 0;
+    _w->bytes_written  = 0;
+    _w->overflows      = 0;
+    _w->dropped_bytes  = 0;
+    _w->max_depth      = 0;
+    _w->max_in_flight  = 0;
+    _w->write_errors   = 0;
+
+    _w->direct      = _direct;
+    _w->aio_depth   = 0;
+    _w->aio_ctx     = 0;
+    _w->iocbs       = NULL;
+    _w->done        = NULL;
+    _w->file_offset = 0;
+    _w->file_base   = 0;
+    _w->next_stream = 0;
+    _w->runs.clear();
+    _w->runs.reserve(64);
+    if (_direct && _aio_depth > 0) {
+        // chunks stay queued until completed, so at most num_chunks-1
+        // writes can ever be in flight
+        if (_aio_depth > _num_chunks - 1)
+            _aio_depth = _num_chunks - 1;
+        if (capture_io_setup(_aio_depth, &_w->aio_ctx) == 0) {
+            _w->aio_depth = _aio_depth;
+            _w->iocbs = new struct iocb[_num_chunks];
+            _w->done  = new unsigned char[_num_chunks]();
+        } else {
+            perror("warning: capture_writer_start(), io_setup; writing synchronously");
+            _w->aio_ctx = 0;
+        }
+    }
+
+    if (pthread_create(&_w->thread, NULL, capture_writer_thread, (void*)_w) != 0) {
+        fprintf(stderr,"error: capture_writer_start(), could not create writer thread\n");
+        if (_w->aio_depth > 0)
+            capture_io_destroy(_w->aio_ctx);
+        delete [] _w->iocbs;
+        delete [] _w->done;
+        delete [] _w->fill;
+        delete [] _w->offset;
+        capture_pool_destroy(&_w->pool);
+        return false;
+    }
+    return true;
+}
+
+// publish the current chunk and move on to the next one; if the writer
+// has fallen a full ring behind, the chunk is dropped (and counted) and
+// refilled instead
+inline void capture_writer_commit(capture_writer *_w)
+{
+    unsigned int n    = _w->pool.num_chunks;
+    unsigned int head = _w->head;
+    unsigned int tail = __atomic_load_n(&_w->tail, __ATOMIC_ACQUIRE);
+    size_t fill = _w->cur_fill;
+
+    if (fill == 0)
+        return;
+
+    _w->cur_fill = 0;
+    unsigned long long offset = _w->read_bytes - fill;
+
+    // the chunk after this one must not still be queued for the writer
+    if (head + 1 - tail >= n) {
+        _w->overflows++;
+        _w->dropped_bytes += fill;
+        return;
+    }
+
+    _w->fill[head % n]   = fill;
+    _w->offset[head % n] = offset;
+    __atomic_store_n(&_w->head, head + 1, __ATOMIC_RELEASE);
+
+    if (head + 1 - tail > _w->max_depth)
+        _w->max_depth = head + 1 - tail;
+
+    _w->cur = capture_pool_chunk(&_w->pool, (head + 1) % n);
+}
+
+// read up to _n bytes from _fd straight into the ring, publishing the
+// current chunk once it is full; chunks are always filled completely so
+// that direct writes stay aligned; returns the result of read()
+inline ssize_t capture_writer_read(capture_writer *_w, int _fd, size_t _n)
+{
+    size_t room = _w->pool.chunk_bytes - _w->cur_fill;
+    ssize_t r = read(_fd, _w->cur + _w->cur_fill, _n < room ? _n : room);
+    if (r <= 0)
+        return r;
+
+    _w->cur_fill   += r;
+    _w->read_bytes += r;
+    if (_w->cur_fill == _w->pool.chunk_bytes)
+        capture_writer_commit(_w);
+    return r;
+}
+
+// attach a processing hook; call after capture_writer_start() but before
+// the first read (the first publish orders it for the writer thread)
+inline void capture_writer_set_process(capture_writer *_w,
+                                       capture_process_func _process,
+                                       void *_ctx)
+{
+    _w->process     = _process;
+    _w->process_ctx = _ctx;
+}
+
+// attach a transform hook, with the same timing rule as
+// capture_writer_set_process(); refused on a direct i/o writer
+inline bool capture_writer_set_transform(capture_writer *_w,
+                                         capture_transform_func _transform,
+                                         void *_ctx)
+{
+    if (_w->direct) {
+        fprintf(stderr,"error: capture_writer_set_transform(), needs a buffered writer\n");
+        return false;
+    }
+    _w->transform     = _transform;
+    _w->transform_ctx = _ctx;
+    return true;
+}
+
+// start the capture _bytes into the file (e.g. past a header), with the
+// same timing rule as capture_writer_set_process(); direct i/o needs an
+// aligned offset
+inline bool capture_writer_set_file_offset(capture_writer *_w, unsigned long long _bytes)
+{
+    if (_w->direct && _bytes % CAPTURE_DIRECT_ALIGN != 0) {
+        fprintf(stderr,"error: capture_writer_set_file_offset(), direct i/o needs a multiple of %d bytes\n",
+                CAPTURE_DIRECT_ALIGN);
+        return false;
+    }
+    if (lseek(_w->fd, _bytes, SEEK_SET) < 0) {
+        perror("capture_writer_set_file_offset(), lseek");
+        return false;
+    }
+    _w->file_base   = _bytes;
+    _w->file_offset = _bytes;
+    return true;
+}
+
+// publish the final partial chunk, drain the ring and stop the writer
+inline void capture_writer_stop(capture_writer *_w)
+{
+    unsigned int n = _w->pool.num_chunks;
+
+    // wait for room rather than dropping the tail of the capture
+    while (_w->cur_fill > 0 &&
+           _w->head + 1 - __atomic_load_n(&_w->tail, __ATOMIC_ACQUIRE) >= n)
+        capture_writer_idle();
+
+    // direct writes of the last chunk are padded to the alignment; zero
+    // the padding here and trim the file back afterwards
+    if (_w->direct && _w->cur_fill > 0) {
+        size_t padded = capture_align_up(_w->cur_fill, CAPTURE_DIRECT_ALIGN);
+        memset(_w->cur + _w->cur_fill, 0, padded - _w->cur_fill);
+    }
+    capture_writer_commit(_w);
+
+    __atomic_store_n(&_w->closed, 1, __ATOMIC_RELEASE);
+    pthread_join(_w->thread, NULL);
+
+    if (_w->direct && ftruncate(_w->fd, _w->file_base + _w->bytes_written) != 0)
+        perror("capture_writer_stop(), ftruncate");
+
+    if (_w->aio_depth > 0)
+        capture_io_destroy(_w->aio_ctx);
+    delete [] _w->iocbs;
+    delete [] _w->done;
+    delete [] _w->fill;
+    delete [] _w->offset;
+    capture_pool_destroy(&_w->pool);
+}
+
+#endif // __NOCTAR_CAPTURE_H__
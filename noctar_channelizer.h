@@ -0,0 +1,260 @@
+/*
+ * noctar_channelizer.h
+ *
+ * in-line decimating channelizer for the Noctar capture stream
+ *
+ * Extracts the channel around the tx frequency from the wideband cshort
+ * capture and decimates it by D, so only the channel reaches the disk.
+ * Mixing down and low-pass filtering are folded into one complex
+ * band-pass filter g[n] = h[n] exp(j w n) followed by a rotation of
+ * each output by exp(-j w t):
+ *
+ *     y[k] = exp(-j w kD) sum_n g[n] x[kD - n]
+ *
+ * and, polyphase style, the filter is only evaluated at the D-th input
+ * samples it is kept for, so the cost is L/D = taps_per_phase complex
+ * multiply-adds per input sample.  h is a Blackman-windowed sinc with
+ * L = D*taps_per_phase taps and its band edge at 0.4 of the output rate.
+ *
+ * Output sample k is raw sample kD (the newest sample in its window),
+ * i.e. the output sample grid is the raw grid decimated by D and delayed
+ * by the filter's (L-1)/2 raw samples, whatever chunks were dropped:
+ * the stream offsets handed in by the writer include dropped chunks,
+ * and outputs falling into a gap are written as zeros.  The output is
+ * cshort again, at the input scale, so the other tools read it as is.
+ */
+
+#ifndef __NOCTAR_CHANNELIZER_H__
+#define __NOCTAR_CHANNELIZER_H__
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+struct channelizer {
+    unsigned int decim;             // D
+    unsigned int num_taps;          // L = D*taps_per_phase
+    double offset;                  // channel center / input rate [cycles/sample]
+
+    std::vector<float> gr, gi;      // band-pass taps, time-reversed
+    std::vector<float> xr, xi;      // L-1 samples of history, then the chunk
+    std::vector<short> out;         // cshort output of the last chunk
+
+    unsigned long long next_in;     // raw index of the next expected sample
+    unsigned long long next_out;    // raw index of the next output (multiple of D)
+
+    // counters
+    unsigned long long outputs;     // output samples produced
+    unsigned long long gap_samples; // raw samples lost to dropped chunks
+};
+
+// y = sum g[n] x[n] over _n complex taps, portable/SSE2 version
+inline void channelizer_dot_sse2(const float *_gr, const float *_gi,
+                                 const float *_xr, const float *_xi,
+                                 unsigned int _n, float *_yr, float *_yi)
+{
+    unsigned int i = 0;
+    float yr = 0.0f, yi = 0.0f;
+#ifdef __SSE2__
+    __m128 ar = _mm_setzero_ps();
+    __m128 ai = _mm_setzero_ps();
+    for (; i + 4 <= _n; i += 4) {
+        __m128 gr = _mm_loadu_ps(_gr + i), gi = _mm_loadu_ps(_gi + i);
+        __m128 xr = _mm_loadu_ps(_xr + i), xi = _mm_loadu_ps(_xi + i);
+        ar = _mm_add_ps(ar, _mm_sub_ps(_mm_mul_ps(gr, xr), _mm_mul_ps(gi, xi)));
+        ai = _mm_add_ps(ai, _mm_add_ps(_mm_mul_ps(gr, xi), _mm_mul_ps(gi, xr)));
+    }
+    float tr[4], ti[4];
+    _mm_storeu_ps(tr, ar);
+    _mm_storeu_ps(ti, ai);
+    yr = (tr[0] + tr[1]) + (tr[2] + tr[3]);
+    yi = (ti[0] + ti[1]) + (ti[2] + ti[3]);
+#endif
+    for (; i < _n; i++) {
+        yr += _gr[i]*_xr[i] - _gi[i]*_xi[i];
+        yi += _gr[i]*_xi[i] + _gi[i]*_xr[i];
+    }
+    *_yr = yr;
+    *_yi = yi;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHANNELIZER_HAVE_AVX_KERNEL 1
+
+// AVX version: eight taps per iteration
+__attribute__((target("avx")))
+inline void channelizer_dot_avx(const float *_gr, const float *_gi,
+                                const float *_xr, const float *_xi,
+                                unsigned int _n, float *_yr, float *_yi)
+{
+    unsigned int i = 0;
+    __m256 ar = _mm256_setzero_ps();
+    __m256 ai = _mm256_setzero_ps();
+    for (; i + 8 <= _n; i += 8) {
+        __m256 gr = _mm256_loadu_ps(_gr + i), gi = _mm256_loadu_ps(_gi + i);
+        __m256 xr = _mm256_loadu_ps(_xr + i), xi = _mm256_loadu_ps(_xi + i);
+        ar = _mm256_add_ps(ar, _mm256_sub_ps(_mm256_mul_ps(gr, xr), _mm256_mul_ps(gi, xi)));
+        ai = _mm256_add_ps(ai, _mm256_add_ps(_mm256_mul_ps(gr, xi), _mm256_mul_ps(gi, xr)));
+    }
+    float tr[8], ti[8];
+    _mm256_storeu_ps(tr, ar);
+    _mm256_storeu_ps(ti, ai);
+    float yr, yi;
+    channelizer_dot_sse2(_gr + i, _gi + i, _xr + i, _xi + i, _n - i, &yr, &yi);
+    for (unsigned int k=0; k<8; k++) {
+        yr += tr[k];
+        yi += ti[k];
+    }
+    *_yr = yr;
+    *_yi = yi;
+}
+#endif
+
+// complex dot product, using the widest kernel the cpu supports
+inline void channelizer_dot(const float *_gr, const float *_gi,
+                            const float *_xr, const float *_xi,
+                            unsigned int _n, float *_yr, float *_yi)
+{
+#ifdef CHANNELIZER_HAVE_AVX_KERNEL
+    static const bool have_avx = __builtin_cpu_supports("avx");
+    if (have_avx) {
+        channelizer_dot_avx(_gr, _gi, _xr, _xi, _n, _yr, _yi);
+        return;
+    }
+#endif
+    channelizer_dot_sse2(_gr, _gi, _xr, _xi, _n, _yr, _yi);
+}
+
+// set up a channelizer for the channel _offset Hz from the center of a
+// capture at _rate samples/s, decimating by _decim with _taps_per_phase
+// taps per polyphase branch
+inline bool channelizer_init(channelizer *_c,
+                             double _rate,
+                             double _offset,
+                             unsigned int _decim,
+                             unsigned int _taps_per_phase)
+{
+    if (_decim < 2 || _taps_per_phase == 0 || _rate <= 0.0) {
+        fprintf(stderr,"error: channelizer_init(), need decimation >= 2, taps and a sample rate\n");
+        return false;
+    }
+    if (fabs(_offset) >= 0.5*_rate) {
+        fprintf(stderr,"error: channelizer_init(), channel offset %.0f Hz outside the capture band\n", _offset);
+        return false;
+    }
+    _c->decim    = _decim;
+    _c->num_taps = _decim * _taps_per_phase;
+    _c->offset   = _offset / _rate;
+
+    // Blackman-windowed sinc, unit gain at dc, band edge at 0.4 of the
+    // output rate; shifted to the channel and stored time-reversed so
+    // the dot product runs forward over the history
+    unsigned int L = _c->num_taps;
+    double fc = 0.4 / _decim;
+    double center = 0.5*(L - 1);
+    std::vector<double> h(L);
+    double sum = 0.0;
+    for (unsigned int n=0; n<L; n++) {
+        double t = n - center;
+        double s = t == 0.0 ? 2.0*fc : sin(2.0*M_PI*fc*t) / (M_PI*t);
+        double w = 0.42 - 0.5*cos(2.0*M_PI*n/(L - 1)) + 0.08*cos(4.0*M_PI*n/(L - 1));
+        h[n] = s*w;
+        sum += h[n];
+    }
+    _c->gr.resize(L);
+    _c->gi.resize(L);
+    for (unsigned int n=0; n<L; n++) {
+        double a = 2.0*M_PI*_c->offset*n;
+        _c->gr[L-1-n] = (float)(h[n]/sum * cos(a));
+        _c->gi[L-1-n] = (float)(h[n]/sum * sin(a));
+    }
+
+    _c->xr.assign(L - 1, 0.0f);
+    _c->xi.assign(L - 1, 0.0f);
+    _c->out.clear();
+    _c->next_in     = 0;
+    _c->next_out    = 0;
+    _c->outputs     = 0;
+    _c->gap_samples = 0;
+    return true;
+}
+
+// round and saturate one output value to cshort
+inline short channelizer_sample_sc16(float _x)
+{
+    if (_x >  32767.0f) _x =  32767.0f;
+    if (_x < -32767.0f) _x = -32767.0f;
+    return (short)lrintf(_x);
+}
+
+// capture_transform_func: channelize one chunk of _n bytes of cshort
+// samples at byte offset _offset of the capture stream; returns the
+// cshort output (valid until the next call) and its size in *_out_n
+inline const char *channelizer_process(void *_ctx,
+                                       const char *_buf,
+                                       size_t _n,
+                                       unsigned long long _offset,
+                                       size_t *_out_n)
+{
+    channelizer *c = (channelizer*)_ctx;
+    const short *x = (const short*)_buf;
+    size_t nin = _n / 4;
+    unsigned long long s0 = _offset / 4;
+    size_t L1 = c->num_taps - 1;
+    c->out.clear();
+
+    // dropped chunks: outputs inside the gap are zero, and the filter
+    // restarts from an empty history
+    if (s0 > c->next_in) {
+        c->gap_samples += s0 - c->next_in;
+        while (c->next_out < s0) {
+            c->out.push_back(0);
+            c->out.push_back(0);
+            c->next_out += c->decim;
+        }
+        memset(&c->xr[0], 0, L1*sizeof(float));
+        memset(&c->xi[0], 0, L1*sizeof(float));
+    }
+
+    c->xr.resize(L1 + nin);
+    c->xi.resize(L1 + nin);
+    for (size_t i=0; i<nin; i++) {
+        c->xr[L1 + i] = x[2*i];
+        c->xi[L1 + i] = x[2*i+1];
+    }
+
+    // one output per D inputs; its window ends at raw sample next_out
+    while (c->next_out < s0 + nin) {
+        size_t p = c->next_out - s0;    // window start in xr/xi
+        float yr, yi;
+        channelizer_dot(&c->gr[0], &c->gi[0], &c->xr[p], &c->xi[p], c->num_taps, &yr, &yi);
+
+        double cycles = c->offset * (double)c->next_out;
+        double a = -2.0*M_PI*(cycles - floor(cycles));
+        float cr = (float)cos(a), ci = (float)sin(a);
+        c->out.push_back(channelizer_sample_sc16(yr*cr - yi*ci));
+        c->out.push_back(channelizer_sample_sc16(yr*ci + yi*cr));
+        c->next_out += c->decim;
+    }
+
+    // keep the last L-1 samples for the next chunk
+    memmove(&c->xr[0], &c->xr[nin], L1*sizeof(float));
+    memmove(&c->xi[0], &c->xi[nin], L1*sizeof(float));
+    c->xr.resize(L1);
+    c->xi.resize(L1);
+    c->next_in = s0 + nin;
+
+    c->outputs += c->out.size() / 2;
+    *_out_n = c->out.size() * sizeof(short);
+    return c->out.empty() ? NULL : (const char*)&c->out[0];
+}
+
+#endif // __NOCTAR_CHANNELIZER_H__
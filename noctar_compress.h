@@ -0,0 +1,433 @@
+/*
+ * noctar_compress.h
+ *
+ * lossless block compression of cshort captures
+ *
+ * Most of a long capture is noise floor, whose samples need far fewer
+ * than 16 bits.  Each block (one slice of a capture chunk) is coded in
+ * frames of 64 samples; per frame and per component (I, Q) the encoder
+ * picks the fixed predictor of order 0, 1 or 2 (raw value, first or
+ * second difference, as in FLAC's fixed predictors) with the smallest
+ * zigzag residuals, and bit-packs the 64 residuals at the width of the
+ * largest one.  A frame costs one header byte per component, so a noise
+ * floor of a few LSB packs to a third or less of its size, while a burst
+ * costs at most a few bits more than raw.
+ *
+ * Every block starts with a header holding its stream offset and sizes,
+ * and predictors restart per block, so blocks decode independently: the
+ * container index (noctar_container.h) lists them for random access, and
+ * a capture without an index can still be walked block by block.
+ *
+ * noctar_compressor is a capture_transform_func for the capture writer.
+ * It splits each chunk into one block per thread and codes them in
+ * parallel: the writer thread codes the first slice itself while
+ * persistent workers, woken through a futex, code the others; the blocks
+ * are then compacted and written in stream order.
+ */
+
+#ifndef __NOCTAR_COMPRESS_H__
+#define __NOCTAR_COMPRESS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <vector>
+
+#include "noctar_futex.h"
+#include "tx_timestamps.h"
+
+#define NOCTAR_COMPRESS_FRAME     64            // samples per frame
+#define NOCTAR_COMPRESS_MAX_WIDTH 19            // order-2 residual of int16
+#define NOCTAR_COMPRESS_MAGIC     0x3142434eu   // "NCB1"
+
+struct noctar_block_header {
+    uint32_t magic;
+    uint32_t samples;           // complex samples in the block
+    uint32_t packed_bytes;      // payload bytes after this header
+    uint32_t reserved;
+    uint64_t stream_offset;     // capture stream byte offset of the first sample
+};
+
+// largest block _samples samples can code to
+inline size_t noctar_compress_bound(size_t _samples)
+{
+    size_t frames = (_samples + NOCTAR_COMPRESS_FRAME - 1) / NOCTAR_COMPRESS_FRAME;
+    return sizeof(noctar_block_header) +
+           frames * (2 + 2*((NOCTAR_COMPRESS_FRAME*NOCTAR_COMPRESS_MAX_WIDTH + 7) / 8));
+}
+
+inline uint32_t noctar_zigzag(int32_t _r)
+{
+    return ((uint32_t)_r << 1) ^ (uint32_t)(_r >> 31);
+}
+
+inline int32_t noctar_unzigzag(uint32_t _z)
+{
+    return (int32_t)(_z >> 1) ^ -(int32_t)(_z & 1);
+}
+
+inline unsigned int noctar_compress_width(uint32_t _or)
+{
+    return _or ? 32 - __builtin_clz(_or) : 0;
+}
+
+// prediction of order _order from the previous two values
+inline int32_t noctar_compress_predict(unsigned int _order, int32_t _p1, int32_t _p2)
+{
+    return _order == 0 ? 0 : _order == 1 ? _p1 : 2*_p1 - _p2;
+}
+
+// pack _m residuals of order ORDER at _w bits each; returns bytes written
+template <unsigned int ORDER>
+inline size_t noctar_compress_pack(const short *_x, unsigned int _m, unsigned int _w,
+                                   int32_t _p1, int32_t _p2, uint8_t *_out)
+{
+    uint8_t *o = _out;
+    uint64_t acc = 0;
+    unsigned int nbits = 0;
+    for (unsigned int i=0; i<_m; i++) {
+        int32_t x = _x[2*i];
+        acc |= (uint64_t)noctar_zigzag(x - noctar_compress_predict(ORDER, _p1, _p2)) << nbits;
+        nbits += _w;
+        if (nbits >= 32) {
+            uint32_t word = (uint32_t)acc;
+            memcpy(o, &word, 4);
+            o += 4;
+            acc >>= 32;
+            nbits -= 32;
+        }
+        _p2 = _p1;
+        _p1 = x;
+    }
+    for (; nbits > 0; nbits = nbits > 8 ? nbits - 8 : 0) {
+        *o++ = (uint8_t)acc;
+        acc >>= 8;
+    }
+    return o - _out;
+}
+
+// code one component (every other short from _x) of a frame of _m
+// samples; _p1/_p2 carry the previous values across frames
+inline size_t noctar_compress_frame(const short *_x, unsigned int _m,
+                                    int32_t *_p1, int32_t *_p2,
+                                    uint8_t *_hdr, uint8_t *_out)
+{
+    // widest residual of each order
+    uint32_t or0 = 0, or1 = 0, or2 = 0;
+    int32_t p1 = *_p1, p2 = *_p2;
+    for (unsigned int i=0; i<_m; i++) {
+        int32_t x = _x[2*i];
+        or0 |= noctar_zigzag(x);
+        or1 |= noctar_zigzag(x - p1);
+        or2 |= noctar_zigzag(x - 2*p1 + p2);
+        p2 = p1;
+        p1 = x;
+    }
+    unsigned int order = 0, w = noctar_compress_width(or0);
+    if (noctar_compress_width(or1) < w) { order = 1; w = noctar_compress_width(or1); }
+    if (noctar_compress_width(or2) < w) { order = 2; w = noctar_compress_width(or2); }
+    *_hdr = (uint8_t)(order << 5 | w);
+
+    size_t n;
+    switch (order) {
+    case 0:  n = noctar_compress_pack<0>(_x, _m, w, *_p1, *_p2, _out); break;
+    case 1:  n = noctar_compress_pack<1>(_x, _m, w, *_p1, *_p2, _out); break;
+    default: n = noctar_compress_pack<2>(_x, _m, w, *_p1, *_p2, _out); break;
+    }
+    *_p1 = p1;
+    *_p2 = p2;
+    return n;
+}
+
+// code _samples cshort samples at stream byte offset _offset into one
+// block at _out (room for noctar_compress_bound(_samples)); returns the
+// block size
+inline size_t noctar_compress_block(const short *_x, size_t _samples,
+                                    unsigned long long _offset, uint8_t *_out)
+{
+    uint8_t *o = _out + sizeof(noctar_block_header);
+    int32_t i1 = 0, i2 = 0, q1 = 0, q2 = 0;
+    for (size_t f=0; f<_samples; f+=NOCTAR_COMPRESS_FRAME) {
+        unsigned int m = _samples - f < NOCTAR_COMPRESS_FRAME ? (unsigned int)(_samples - f) : NOCTAR_COMPRESS_FRAME;
+        uint8_t *hdr = o;
+        o += 2;
+        o += noctar_compress_frame(_x + 2*f,     m, &i1, &i2, &hdr[0], o);
+        o += noctar_compress_frame(_x + 2*f + 1, m, &q1, &q2, &hdr[1], o);
+    }
+
+    noctar_block_header h;
+    h.magic         = NOCTAR_COMPRESS_MAGIC;
+    h.samples       = (uint32_t)_samples;
+    h.packed_bytes  = (uint32_t)(o - _out - sizeof(h));
+    h.reserved      = 0;
+    h.stream_offset = _offset;
+    memcpy(_out, &h, sizeof(h));
+    return o - _out;
+}
+
+// header of the block at _in (_avail bytes readable); false if there is
+// no complete block there
+inline bool noctar_block_read_header(const uint8_t *_in, size_t _avail, noctar_block_header *_h)
+{
+    if (_avail < sizeof(*_h))
+        return false;
+    memcpy(_h, _in, sizeof(*_h));
+    return _h->magic == NOCTAR_COMPRESS_MAGIC &&
+           _h->packed_bytes <= _avail - sizeof(*_h) &&
+           _h->packed_bytes <= noctar_compress_bound(_h->samples);
+}
+
+// decode one component of a frame; false on a corrupt frame
+inline bool noctar_decompress_frame(const uint8_t **_in, const uint8_t *_end, uint8_t _hdr,
+                                    unsigned int _m, int32_t *_p1, int32_t *_p2, short *_x)
+{
+    unsigned int order = _hdr >> 5, w = _hdr & 31;
+    size_t bytes = ((size_t)_m*w + 7) / 8;
+    if (order > 2 || w > NOCTAR_COMPRESS_MAX_WIDTH || bytes > (size_t)(_end - *_in))
+        return false;
+
+    const uint8_t *in = *_in;
+    uint64_t acc = 0;
+    unsigned int nbits = 0;
+    uint32_t mask = w < 32 ? (1u << w) - 1 : 0xffffffffu;
+    int32_t p1 = *_p1, p2 = *_p2;
+    for (unsigned int i=0; i<_m; i++) {
+        while (nbits < w) {
+            acc |= (uint64_t)*in++ << nbits;
+            nbits += 8;
+        }
+        int32_t x = noctar_unzigzag((uint32_t)acc & mask) + noctar_compress_predict(order, p1, p2);
+        acc >>= w;
+        nbits -= w;
+        _x[2*i] = (short)x;
+        p2 = p1;
+        p1 = x;
+    }
+    *_in = *_in + bytes;
+    *_p1 = p1;
+    *_p2 = p2;
+    return true;
+}
+
+// decode the block at _in (checked with noctar_block_read_header) into
+// _h.samples cshort samples at _x; false on a corrupt block
+inline bool noctar_decompress_block(const uint8_t *_in, const noctar_block_header &_h, short *_x)
+{
+    const uint8_t *in  = _in + sizeof(_h);
+    const uint8_t *end = in + _h.packed_bytes;
+    int32_t i1 = 0, i2 = 0, q1 = 0, q2 = 0;
+    for (size_t f=0; f<_h.samples; f+=NOCTAR_COMPRESS_FRAME) {
+        unsigned int m = _h.samples - f < NOCTAR_COMPRESS_FRAME ? (unsigned int)(_h.samples - f) : NOCTAR_COMPRESS_FRAME;
+        if (end - in < 2)
+            return false;
+        uint8_t hi = in[0], hq = in[1];
+        in += 2;
+        if (!noctar_decompress_frame(&in, end, hi, m, &i1, &i2, _x + 2*f) ||
+            !noctar_decompress_frame(&in, end, hq, m, &q1, &q2, _x + 2*f + 1))
+            return false;
+    }
+    return true;
+}
+
+// one block as written, for the container index
+struct noctar_compress_block_info {
+    unsigned long long stream_offset;   // capture stream byte offset
+    unsigned long long packed_offset;   // offset in the compressed output
+    unsigned int samples;
+};
+
+struct noctar_compressor;
+
+struct noctar_compress_worker {
+    noctar_compressor *c;
+    unsigned int slice;
+    pthread_t thread;
+};
+
+struct noctar_compressor {
+    unsigned int num_threads;           // slices per chunk
+    std::vector<noctar_compress_worker> workers;    // slices 1..num_threads-1
+    std::vector<uint8_t> out;           // one slice_bound per slice, then compacted
+    size_t max_samples;                 // largest chunk [samples]
+    size_t slice_bound;
+
+    // current chunk, published by bumping job_seq (futex word)
+    const short *x;
+    size_t samples;
+    size_t slice_samples;
+    unsigned long long offset;
+    std::vector<size_t> slice_bytes;
+    unsigned int job_seq;
+    unsigned int done;                  // workers finished (futex word)
+    int quit;
+
+    // blocks in output order
+    std::vector<noctar_compress_block_info> blocks;
+
+    // counters
+    unsigned long long raw_bytes;
+    unsigned long long packed_bytes;
+    unsigned long long busy_ns;         // time spent coding
+    unsigned long long max_chunk_ns;    // slowest chunk
+    unsigned long long odd_bytes;       // bytes not forming a whole sample
+};
+
+// code slice _k of the current chunk into its slot of the output
+inline void noctar_compressor_slice(noctar_compressor *_c, unsigned int _k)
+{
+    size_t begin = _k * _c->slice_samples;
+    if (begin >= _c->samples) {
+        _c->slice_bytes[_k] = 0;
+        return;
+    }
+    size_t n = _c->samples - begin < _c->slice_samples ? _c->samples - begin : _c->slice_samples;
+    _c->slice_bytes[_k] = noctar_compress_block(_c->x + 2*begin, n, _c->offset + 4*begin,
+                                                &_c->out[_k * _c->slice_bound]);
+}
+
+inline void *noctar_compress_worker_thread(void *_arg)
+{
+    noctar_compress_worker *w = (noctar_compress_worker*)_arg;
+    noctar_compressor *c = w->c;
+    unsigned int seen = 0;
+    while (true) {
+        unsigned int seq = __atomic_load_n(&c->job_seq, __ATOMIC_ACQUIRE);
+        if (seq == seen) {
+            noctar_futex_wait(&c->job_seq, seen);
+            continue;
+        }
+        if (__atomic_load_n(&c->quit, __ATOMIC_ACQUIRE))
+            break;
+        seen = seq;
+        noctar_compressor_slice(c, w->slice);
+        __atomic_add_fetch(&c->done, 1, __ATOMIC_RELEASE);
+        noctar_futex_wake(&c->done, 1);
+    }
+    return NULL;
+}
+
+// stop and join the workers
+inline void noctar_compressor_stop(noctar_compressor *_c)
+{
+    __atomic_store_n(&_c->quit, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&_c->job_seq, 1, __ATOMIC_RELEASE);
+    noctar_futex_wake(&_c->job_seq, INT_MAX);
+    for (unsigned int k=0; k<_c->workers.size(); k++)
+        pthread_join(_c->workers[k].thread, NULL);
+    _c->workers.clear();
+}
+
+// set up a compressor for chunks of up to _max_bytes coded on
+// _num_threads threads (the writer thread included); buffers are sized
+// and touched here, off the capture path.  Fails (with no thread left
+// running) if a worker cannot be created.
+inline bool noctar_compressor_start(noctar_compressor *_c, unsigned int _num_threads, size_t _max_bytes)
+{
+    if (_num_threads == 0)
+        _num_threads = 1;
+    _c->num_threads   = _num_threads;
+    _c->max_samples   = _max_bytes / 4;
+    size_t slice      = (_c->max_samples + _num_threads - 1) / _num_threads;
+    _c->slice_bound   = noctar_compress_bound(slice + NOCTAR_COMPRESS_FRAME);
+    _c->out.assign(_c->slice_bound * _num_threads, 0);
+    _c->slice_bytes.assign(_num_threads, 0);
+    _c->x             = NULL;
+    _c->samples       = 0;
+    _c->slice_samples = 0;
+    _c->offset        = 0;
+    _c->job_seq       = 0;
+    _c->done          = 0;
+    _c->quit          = 0;
+    _c->blocks.clear();
+    _c->blocks.reserve(4096);
+    _c->raw_bytes     = 0;
+    _c->packed_bytes  = 0;
+    _c->busy_ns       = 0;
+    _c->max_chunk_ns  = 0;
+    _c->odd_bytes     = 0;
+
+    // reserved up front: the workers hold pointers into the vector
+    _c->workers.clear();
+    _c->workers.reserve(_num_threads - 1);
+    for (unsigned int k=1; k<_num_threads; k++) {
+        noctar_compress_worker w;
+        w.c     = _c;
+        w.slice = k;
+        _c->workers.push_back(w);
+        if (pthread_create(&_c->workers.back().thread, NULL, noctar_compress_worker_thread,
+                           (void*)&_c->workers.back()) != 0)
+        {
+            fprintf(stderr,"error: noctar_compressor_start(), could not create compression thread\n");
+            _c->workers.pop_back();
+            noctar_compressor_stop(_c);
+            return false;
+        }
+    }
+    return true;
+}
+
+// capture_transform_func: code one chunk as num_threads blocks; returns
+// the blocks (valid until the next call) and their size in *_out_n
+inline const char *noctar_compressor_process(void *_ctx,
+                                             const char *_buf,
+                                             size_t _n,
+                                             unsigned long long _offset,
+                                             size_t *_out_n)
+{
+    noctar_compressor *c = (noctar_compressor*)_ctx;
+    unsigned long long t0 = noctar_clock_ns();
+
+    // chunks are whole pages, so only a short final read can leave a
+    // partial sample; it is counted rather than coded
+    c->x       = (const short*)_buf;
+    c->samples = _n / 4;
+    c->offset  = _offset;
+    c->odd_bytes += _n % 4;
+    if (c->samples > c->max_samples)
+        c->samples = c->max_samples;
+    size_t slice = (c->samples + c->num_threads - 1) / c->num_threads;
+    c->slice_samples = (slice + NOCTAR_COMPRESS_FRAME - 1) / NOCTAR_COMPRESS_FRAME * NOCTAR_COMPRESS_FRAME;
+
+    // fork: the workers take slices 1.., this thread slice 0; join
+    unsigned int workers = c->workers.size();
+    if (workers > 0) {
+        __atomic_store_n(&c->done, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->job_seq, 1, __ATOMIC_RELEASE);
+        noctar_futex_wake(&c->job_seq, INT_MAX);
+    }
+    noctar_compressor_slice(c, 0);
+    unsigned int d;
+    while ((d = __atomic_load_n(&c->done, __ATOMIC_ACQUIRE)) < workers)
+        noctar_futex_wait(&c->done, d);
+
+    // compact the blocks in slice order and list them
+    size_t pos = 0;
+    for (unsigned int k=0; k<c->num_threads; k++) {
+        size_t bytes = c->slice_bytes[k];
+        if (bytes == 0)
+            continue;
+        if (pos != k * c->slice_bound)
+            memmove(&c->out[pos], &c->out[k * c->slice_bound], bytes);
+        noctar_compress_block_info b;
+        b.stream_offset = _offset + 4ull * k * c->slice_samples;
+        b.packed_offset = c->packed_bytes + pos;
+        b.samples       = (unsigned int)((k + 1) * c->slice_samples < c->samples ?
+                                         c->slice_samples : c->samples - k * c->slice_samples);
+        c->blocks.push_back(b);
+        pos += bytes;
+    }
+
+    c->raw_bytes    += 4*c->samples;
+    c->packed_bytes += pos;
+    unsigned long long dt = noctar_clock_ns() - t0;
+    c->busy_ns += dt;
+    if (dt > c->max_chunk_ns)
+        c->max_chunk_ns = dt;
+
+    *_out_n = pos;
+    return pos > 0 ? (const char*)&c->out[0] : NULL;
+}
+
+#endif // __NOCTAR_COMPRESS_H__
@@ -0,0 +1,202 @@
+/*
+ * noctar_config.h
+ *
+ * capture settings shared by the packet_tx tools
+ *
+ * Settings come from built-in defaults, then an optional config file of
+ * "key = value" lines ('#' starts a comment), then the command line.
+ */
+
+#ifndef __NOCTAR_CONFIG_H__
+#define __NOCTAR_CONFIG_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+struct capture_config {
+    unsigned int read_samples;      // samples per read() of /dev/langford
+    unsigned int chunk_kbytes;      // capture chunk size [KiB]
+    unsigned int ring_chunks;       // number of chunks in the writer ring
+    unsigned int alignment;         // chunk alignment [bytes] (0: page)
+    unsigned int aio_depth;         // O_DIRECT writes in flight (0: buffered)
+
+    // thread placement (buffers follow their thread's NUMA node)
+    int reader_cpu;                 // cpu for the Noctar reader (-1: any)
+    int writer_cpu;                 // cpu for the capture writer (-1: any)
+    int tx_cpu;                     // cpu for the transmit worker (-1: any)
+    int async_cpu;                  // cpu for the tx async monitor (-1: any)
+    bool mlock;                     // mlockall() at startup
+    bool container;                 // header + index around the samples
+                                    // (noctar_container.h), else raw
+    unsigned int compress_threads;  // lossless block compression threads
+                                    // (noctar_compress.h, 0: off)
+
+    // burst onset detector
+    unsigned int detect_window;     // window length [samples] (0: off)
+    float detect_threshold;         // onset power ratio threshold
+
+    // channelizer: keep only the tx channel on disk
+    unsigned int channel_decim;     // decimation (0: store raw samples)
+    unsigned int channel_taps;      // filter taps per polyphase branch
+    double channel_offset;          // channel center from the Noctar center [Hz]
+    double noctar_rate;             // Noctar complex sample rate [samples/s]
+    double noctar_center;           // Noctar center frequency [Hz] (0: unknown,
+                                    // use channel_offset)
+    unsigned int decode_threads;    // framesync64 workers on the channel (0: off)
+
+    // sweep mode
+    std::vector<unsigned int> sweep_read_samples;   // read sizes to try
+    double sweep_seconds;                           // duration per setting
+};
+
+inline void capture_config_init(capture_config *_cfg, unsigned int _read_samples)
+{
+    _cfg->read_samples = _read_samples;
+    _cfg->chunk_kbytes = 4096;
+    _cfg->ring_chunks  = 16;
+    _cfg->alignment    = 0;
+    _cfg->aio_depth    = 0;
+
+    _cfg->reader_cpu = -1;
+    _cfg->writer_cpu = -1;
+    _cfg->tx_cpu     = -1;
+    _cfg->async_cpu  = -1;
+    _cfg->mlock      = true;
+    _cfg->container  = true;
+    _cfg->compress_threads = 0;
+
+    _cfg->detect_window    = 0;
+    _cfg->detect_threshold = 10.0f;
+
+    _cfg->channel_decim  = 0;
+    _cfg->channel_taps   = 12;
+    _cfg->channel_offset = 0.0;
+    _cfg->noctar_rate    = 2.4e9/32;
+    _cfg->noctar_center  = 0.0;
+    _cfg->decode_threads = 0;
+
+    static const unsigned int sweep[] = {64, 128, 256, 512, 1024, 4096, 16384, 65536};
+    _cfg->sweep_read_samples.assign(sweep, sweep + sizeof(sweep)/sizeof(sweep[0]));
+    _cfg->sweep_seconds = 1.0;
+}
+
+// parse a comma-separated list of unsigned integers
+inline std::vector<unsigned int> capture_config_parse_list(const char *_s)
+{
+    std::vector<unsigned int> v;
+    const char *p = _s;
+    while (*p) {
+        char *end;
+        unsigned long x = strtoul(p, &end, 0);
+        if (end == p)
+            break;
+        v.push_back((unsigned int)x);
+        p = end;
+        while (*p == ',' || *p == ' ')
+            p++;
+    }
+    return v;
+}
+
+// set one key; returns false for unknown keys
+inline bool capture_config_set(capture_config *_cfg, const char *_key, const char *_value)
+{
+    if      (strcmp(_key, "read_samples") == 0)       _cfg->read_samples = atoi(_value);
+    else if (strcmp(_key, "chunk_kbytes") == 0)       _cfg->chunk_kbytes = atoi(_value);
+    else if (strcmp(_key, "ring_chunks") == 0)        _cfg->ring_chunks  = atoi(_value);
+    else if (strcmp(_key, "alignment") == 0)          _cfg->alignment    = atoi(_value);
+    else if (strcmp(_key, "aio_depth") == 0)          _cfg->aio_depth    = atoi(_value);
+    else if (strcmp(_key, "reader_cpu") == 0)         _cfg->reader_cpu = atoi(_value);
+    else if (strcmp(_key, "writer_cpu") == 0)         _cfg->writer_cpu = atoi(_value);
+    else if (strcmp(_key, "tx_cpu") == 0)             _cfg->tx_cpu     = atoi(_value);
+    else if (strcmp(_key, "async_cpu") == 0)          _cfg->async_cpu  = atoi(_value);
+    else if (strcmp(_key, "mlock") == 0)              _cfg->mlock      = atoi(_value) != 0;
+    else if (strcmp(_key, "container") == 0)          _cfg->container  = atoi(_value) != 0;
+    else if (strcmp(_key, "compress_threads") == 0)   _cfg->compress_threads = atoi(_value);
+    else if (strcmp(_key, "detect_window") == 0)      _cfg->detect_window = atoi(_value);
+    else if (strcmp(_key, "detect_threshold") == 0)   _cfg->detect_threshold = atof(_value);
+    else if (strcmp(_key, "channel_decim") == 0)      _cfg->channel_decim  = atoi(_value);
+    else if (strcmp(_key, "channel_taps") == 0)       _cfg->channel_taps   = atoi(_value);
+    else if (strcmp(_key, "channel_offset") == 0)     _cfg->channel_offset = atof(_value);
+    else if (strcmp(_key, "noctar_rate") == 0)        _cfg->noctar_rate    = atof(_value);
+    else if (strcmp(_key, "noctar_center") == 0)      _cfg->noctar_center  = atof(_value);
+    else if (strcmp(_key, "decode_threads") == 0)     _cfg->decode_threads = atoi(_value);
+    else if (strcmp(_key, "sweep_read_samples") == 0) _cfg->sweep_read_samples = capture_config_parse_list(_value);
+    else if (strcmp(_key, "sweep_seconds") == 0)      _cfg->sweep_seconds = atof(_value);
+    else return false;
+    return true;
+}
+
+// load "key = value" lines from _filename
+inline bool capture_config_load(capture_config *_cfg, const char *_filename)
+{
+    FILE *fid = fopen(_filename, "r");
+    if (fid == NULL) {
+        fprintf(stderr,"error: could not open config file '%s'\n", _filename);
+        return false;
+    }
+
+    char line[1024];
+    unsigned int lineno = 0;
+    while (fgets(line, sizeof(line), fid) != NULL) {
+        lineno++;
+
+        // strip comments and trailing whitespace
+        char *c = strchr(line, '#');
+        if (c) *c = '\0';
+        size_t n = strlen(line);
+        while (n > 0 && strchr(" \t\r\n", line[n-1]))
+            line[--n] = '\0';
+
+        char *key = line + strspn(line, " \t");
+        if (*key == '\0')
+            continue;
+
+        char *eq = strchr(key, '=');
+        if (eq == NULL) {
+            fprintf(stderr,"warning: %s:%u, expected 'key = value'\n", _filename, lineno);
+            continue;
+        }
+        char *value = eq + 1 + strspn(eq + 1, " \t");
+        do { *eq-- = '\0'; } while (eq >= key && (*eq == ' ' || *eq == '\t'));
+
+        if (!capture_config_set(_cfg, key, value))
+            fprintf(stderr,"warning: %s:%u, unknown key '%s'\n", _filename, lineno, key);
+    }
+    fclose(fid);
+    return true;
+}
+
+// sanity-check the settings; returns false (with a message) if unusable
+inline bool capture_config_validate(const capture_config *_cfg)
+{
+    if (_cfg->read_samples == 0) {
+        fprintf(stderr,"error: read size must be at least one sample\n");
+        return false;
+    }
+    if (_cfg->alignment & (_cfg->alignment - 1)) {
+        fprintf(stderr,"error: alignment must be a power of two\n");
+        return false;
+    }
+    if (_cfg->channel_decim == 1 || (_cfg->channel_decim > 0 && _cfg->channel_taps == 0)) {
+        fprintf(stderr,"error: channelizer needs a decimation of at least 2 and some taps\n");
+        return false;
+    }
+    if (_cfg->decode_threads > 0 && _cfg->channel_decim == 0) {
+        fprintf(stderr,"error: frame decoding runs on the channelizer output, set channel_decim\n");
+        return false;
+    }
+    if (_cfg->compress_threads > 0 && (_cfg->channel_decim > 0 || !_cfg->container)) {
+        fprintf(stderr,"error: compression is for raw captures in a container, set channel_decim = 0 and container = 1\n");
+        return false;
+    }
+    if (_cfg->ring_chunks < 2) {
+        fprintf(stderr,"error: writer ring needs at least two chunks\n");
+        return false;
+    }
+    return true;
+}
+
+#endif // __NOCTAR_CONFIG_H__
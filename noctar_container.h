@@ -0,0 +1,408 @@
+/*
+ * noctar_container.h
+ *
+ * self-describing capture container
+ *
+ * Instead of a bare noctar_samples file whose meaning lives in the text
+ * log, a capture can be written as one container:
+ *
+ *     [header, 4 KiB] [body: cshort samples] [pad] [index]
+ *
+ * The header records what the body is (format, sample rate, decimation
+ * and delay against the raw Noctar grid, center and tx frequency, gains,
+ * chunk size) and where the index starts.  The body is written chunk by
+ * chunk by the capture writer straight after the header, which keeps it
+ * aligned for O_DIRECT; sample k of the body is at a fixed file offset,
+ * so the file can be memory-mapped and indexed directly.  The trailing
+ * index is an array of fixed-size entries: the contiguous runs of the
+ * body (one more after each chunk dropped on a full ring), the tx bursts
+ * and their send/EOB events, the burst detections and the decoded rx
+ * frames, all stamped with raw Noctar sample indices, so a tool can look
+ * up a burst and jump straight to its samples.
+ *
+ * The header is written once with body_bytes = 0 before the capture
+ * starts and rewritten when the index is in place, so a capture cut
+ * short still identifies itself (its body runs to the end of the file).
+ * Fields are host byte order (little-endian on the capture machines).
+ *
+ * A compressed body (NOCTAR_FORMAT_SC16_PACKED) is a sequence of blocks
+ * from noctar_compress.h instead of bare samples; the index then lists
+ * every block with its raw sample and body offset, and a range of raw
+ * samples is read by decoding only the blocks that overlap it.
+ */
+
+#ifndef __NOCTAR_CONTAINER_H__
+#define __NOCTAR_CONTAINER_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <vector>
+
+#include "noctar_compress.h"
+
+#define NOCTAR_CONTAINER_MAGIC        "NOCTCAP"     // 8 bytes with the NUL
+#define NOCTAR_CONTAINER_VERSION      1
+#define NOCTAR_CONTAINER_HEADER_BYTES 4096          // body offset (O_DIRECT aligned)
+#define NOCTAR_CONTAINER_INDEX_ALIGN  64
+
+enum noctar_sample_format {
+    NOCTAR_FORMAT_SC16 = 1,         // interleaved int16 I/Q
+    NOCTAR_FORMAT_SC16_PACKED,      // SC16 in noctar_compress.h blocks
+};
+
+struct noctar_container_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;          // body starts here
+    uint32_t sample_format;         // noctar_sample_format
+    uint32_t sample_bytes;          // bytes per complex sample (decoded)
+    uint32_t decimation;            // body sample k is raw sample k*decimation
+    uint32_t reserved;
+    double sample_rate;             // body sample rate [samples/s]
+    double noctar_rate;             // raw Noctar sample rate [samples/s]
+    double noctar_center;           // Noctar center frequency [Hz] (0: unknown)
+    double channel_offset;          // body center from the Noctar center [Hz]
+    double channel_delay;           // filter delay of the body [raw samples]
+    double tx_frequency;            // usrp tx center frequency [Hz]
+    double tx_rate;                 // usrp tx sample rate [samples/s]
+    double tx_gain_dB;              // software tx gain of the default burst
+    double uhd_gain;                // usrp tx gain [dB]
+    uint64_t chunk_bytes;           // capture chunk size
+    uint64_t body_bytes;            // 0: capture not finalized (stored bytes)
+    uint64_t raw_samples;           // raw samples read, dropped ones included
+    uint64_t dropped_samples;       // raw samples dropped on a full ring
+    uint64_t index_offset;          // file offset of the index
+    uint64_t index_count;           // entries in the index
+    int64_t created;                // unix time the capture started
+};
+
+enum noctar_index_type {
+    NOCTAR_INDEX_RUN = 1,           // sample: first raw sample of a contiguous
+                                    //   run, aux: its body sample
+    NOCTAR_INDEX_TX_BURST,          // id: burst, sample: trigger, aux: end,
+                                    //   value: frequency [Hz], flags: 1 if acked
+    NOCTAR_INDEX_TX_SEND_DONE,      // id: burst, sample: send() of the EOB returned
+    NOCTAR_INDEX_TX_EVENT,          // id: tx_event_type, value: exact raw sample
+    NOCTAR_INDEX_DETECTION,         // sample: onset, aux: end, value: peak power
+    NOCTAR_INDEX_RX_FRAME,          // id: packet id, value: evm [dB],
+                                    //   flags: 1 header valid, 2 payload valid
+    NOCTAR_INDEX_END,               // sample: end of program
+    NOCTAR_INDEX_BLOCK,             // id: block, sample: its first raw sample,
+                                    //   aux: body byte offset, value: samples
+};
+
+struct noctar_index_entry {
+    uint32_t type;                  // noctar_index_type
+    uint32_t id;
+    uint64_t sample;                // raw Noctar sample index
+    uint64_t aux;
+    double value;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+inline const char *noctar_index_name(uint32_t _type)
+{
+    switch (_type) {
+    case NOCTAR_INDEX_RUN:          return "run";
+    case NOCTAR_INDEX_TX_BURST:     return "tx_burst";
+    case NOCTAR_INDEX_TX_SEND_DONE: return "tx_send_done";
+    case NOCTAR_INDEX_TX_EVENT:     return "tx_event";
+    case NOCTAR_INDEX_DETECTION:    return "detection";
+    case NOCTAR_INDEX_RX_FRAME:     return "rx_frame";
+    case NOCTAR_INDEX_END:          return "end";
+    case NOCTAR_INDEX_BLOCK:        return "block";
+    default:                        return "unknown";
+    }
+}
+
+inline noctar_index_entry noctar_index_make(uint32_t _type, uint32_t _id,
+                                            uint64_t _sample, uint64_t _aux = 0,
+                                            double _value = 0.0, uint32_t _flags = 0)
+{
+    noctar_index_entry e;
+    memset(&e, 0, sizeof(e));
+    e.type   = _type;
+    e.id     = _id;
+    e.sample = _sample;
+    e.aux    = _aux;
+    e.value  = _value;
+    e.flags  = _flags;
+    return e;
+}
+
+inline void noctar_container_header_init(noctar_container_header *_h)
+{
+    memset(_h, 0, sizeof(*_h));
+    memcpy(_h->magic, NOCTAR_CONTAINER_MAGIC, sizeof(_h->magic));
+    _h->version       = NOCTAR_CONTAINER_VERSION;
+    _h->header_bytes  = NOCTAR_CONTAINER_HEADER_BYTES;
+    _h->sample_format = NOCTAR_FORMAT_SC16;
+    _h->sample_bytes  = 4;
+    _h->decimation    = 1;
+}
+
+// write _n bytes at _offset of _fd, retrying on short writes
+inline bool noctar_container_pwrite(int _fd, const void *_buf, size_t _n, off_t _offset)
+{
+    const char *p = (const char*)_buf;
+    while (_n > 0) {
+        ssize_t r = pwrite(_fd, p, _n, _offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p       += r;
+        _n      -= r;
+        _offset += r;
+    }
+    return true;
+}
+
+// write the header block of _path (already created by the capture); done
+// through its own buffered descriptor so the capture's may be O_DIRECT
+inline bool noctar_container_write_header(const char *_path, const noctar_container_header *_h)
+{
+    int fd = open(_path, O_WRONLY);
+    if (fd < 0) {
+        fprintf(stderr,"error: noctar_container_write_header(), '%s': %s\n", _path, strerror(errno));
+        return false;
+    }
+    std::vector<char> block(NOCTAR_CONTAINER_HEADER_BYTES, 0);
+    memcpy(&block[0], _h, sizeof(*_h));
+    bool ok = noctar_container_pwrite(fd, &block[0], block.size(), 0);
+    if (!ok)
+        fprintf(stderr,"error: noctar_container_write_header(), '%s': %s\n", _path, strerror(errno));
+    close(fd);
+    return ok;
+}
+
+// append _index after a body of _body_bytes and finalize the header
+inline bool noctar_container_finish(const char *_path,
+                                    noctar_container_header *_h,
+                                    unsigned long long _body_bytes,
+                                    const std::vector<noctar_index_entry> &_index)
+{
+    unsigned long long end = _h->header_bytes + _body_bytes;
+    _h->body_bytes   = _body_bytes;
+    _h->index_offset = (end + NOCTAR_CONTAINER_INDEX_ALIGN - 1) & ~(unsigned long long)(NOCTAR_CONTAINER_INDEX_ALIGN - 1);
+    _h->index_count  = _index.size();
+
+    int fd = open(_path, O_WRONLY);
+    if (fd < 0) {
+        fprintf(stderr,"error: noctar_container_finish(), '%s': %s\n", _path, strerror(errno));
+        return false;
+    }
+    bool ok = _index.empty() ||
+              noctar_container_pwrite(fd, &_index[0], _index.size()*sizeof(noctar_index_entry), _h->index_offset);
+    close(fd);
+    if (!ok) {
+        fprintf(stderr,"error: noctar_container_finish(), index of '%s': %s\n", _path, strerror(errno));
+        return false;
+    }
+    return noctar_container_write_header(_path, _h);
+}
+
+// reader side: a container mapped by the caller
+struct noctar_container {
+    const noctar_container_header *header;
+    const short *body;                  // interleaved I/Q (NULL if packed)
+    unsigned long long body_samples;
+    const uint8_t *packed;              // compressed body (NULL if not)
+    unsigned long long packed_bytes;
+    const noctar_index_entry *index;
+    unsigned long long index_count;
+};
+
+// whether the _bytes at _data start with a container header
+inline bool noctar_container_detect(const void *_data, size_t _bytes)
+{
+    return _bytes >= sizeof(noctar_container_header) &&
+           memcmp(_data, NOCTAR_CONTAINER_MAGIC, sizeof(NOCTAR_CONTAINER_MAGIC)) == 0;
+}
+
+// parse the container in [_data, _data+_bytes); false (with a message)
+// if it is malformed
+inline bool noctar_container_parse(noctar_container *_c, const void *_data, size_t _bytes)
+{
+    if (!noctar_container_detect(_data, _bytes)) {
+        fprintf(stderr,"error: noctar_container_parse(), not a capture container\n");
+        return false;
+    }
+    const noctar_container_header *h = (const noctar_container_header*)_data;
+    if (h->version != NOCTAR_CONTAINER_VERSION) {
+        fprintf(stderr,"error: noctar_container_parse(), unsupported version %u\n", h->version);
+        return false;
+    }
+    bool packed = h->sample_format == NOCTAR_FORMAT_SC16_PACKED;
+    if ((h->sample_format != NOCTAR_FORMAT_SC16 && !packed) || h->sample_bytes != 4 || h->decimation == 0 ||
+        h->header_bytes < sizeof(*h) || h->header_bytes > _bytes)
+    {
+        fprintf(stderr,"error: noctar_container_parse(), bad header\n");
+        return false;
+    }
+
+    _c->header      = h;
+    _c->body        = (const short*)((const char*)_data + h->header_bytes);
+    _c->index       = NULL;
+    _c->index_count = 0;
+
+    // not finalized: the body is whatever made it to disk
+    unsigned long long body_bytes = h->body_bytes;
+    if (body_bytes == 0) {
+        fprintf(stderr,"warning: capture container was not finalized, it has no index\n");
+        body_bytes = _bytes - h->header_bytes;
+    } else if (h->header_bytes + body_bytes > _bytes ||
+               h->index_offset + h->index_count*sizeof(noctar_index_entry) > _bytes ||
+               h->index_offset % NOCTAR_CONTAINER_INDEX_ALIGN != 0)
+    {
+        fprintf(stderr,"error: noctar_container_parse(), body or index past the end of the file\n");
+        return false;
+    } else {
+        _c->index       = (const noctar_index_entry*)((const char*)_data + h->index_offset);
+        _c->index_count = h->index_count;
+    }
+    _c->body_samples = body_bytes / h->sample_bytes;
+    _c->packed       = NULL;
+    _c->packed_bytes = 0;
+    if (packed) {
+        _c->packed       = (const uint8_t*)_c->body;
+        _c->packed_bytes = body_bytes;
+        _c->body         = NULL;
+        _c->body_samples = 0;
+    }
+    return true;
+}
+
+// blocks of a packed body, as index entries: from the index, or for a
+// capture that was not finalized, by walking the block headers
+inline void noctar_container_blocks(const noctar_container *_c, std::vector<noctar_index_entry> *_blocks)
+{
+    _blocks->clear();
+    for (unsigned long long i=0; i<_c->index_count; i++) {
+        if (_c->index[i].type == NOCTAR_INDEX_BLOCK)
+            _blocks->push_back(_c->index[i]);
+    }
+    if (!_blocks->empty() || _c->index != NULL)
+        return;
+
+    noctar_block_header h;
+    unsigned long long pos = 0;
+    while (noctar_block_read_header(_c->packed + pos, _c->packed_bytes - pos, &h)) {
+        _blocks->push_back(noctar_index_make(NOCTAR_INDEX_BLOCK, _blocks->size(), h.stream_offset / 4,
+                                             pos, h.samples));
+        pos += sizeof(h) + h.packed_bytes;
+    }
+}
+
+// decode raw samples [_first, _last) of a packed body into _x, with
+// samples dropped at capture time (or past the end) left zero; only the
+// blocks overlapping the range are decoded
+inline bool noctar_container_unpack(const noctar_container *_c,
+                                    unsigned long long _first,
+                                    unsigned long long _last,
+                                    std::vector<short> *_x)
+{
+    std::vector<noctar_index_entry> blocks;
+    noctar_container_blocks(_c, &blocks);
+    _x->assign(2*(_last - _first), 0);
+
+    std::vector<short> tmp;
+    for (unsigned int b=0; b<blocks.size(); b++) {
+        const noctar_index_entry &e = blocks[b];
+        unsigned long long n = (unsigned long long)e.value;
+        if (e.sample + n <= _first || e.sample >= _last)
+            continue;
+
+        noctar_block_header h;
+        if (e.aux >= _c->packed_bytes ||
+            !noctar_block_read_header(_c->packed + e.aux, _c->packed_bytes - e.aux, &h) ||
+            h.stream_offset / 4 != e.sample)
+        {
+            fprintf(stderr,"error: noctar_container_unpack(), block %u is not where the index says\n", e.id);
+            return false;
+        }
+        tmp.resize(2*(size_t)h.samples);
+        if (!noctar_decompress_block(_c->packed + e.aux, h, &tmp[0])) {
+            fprintf(stderr,"error: noctar_container_unpack(), block %u is corrupt\n", e.id);
+            return false;
+        }
+        unsigned long long a = e.sample > _first ? e.sample : _first;
+        unsigned long long z = e.sample + h.samples < _last ? e.sample + h.samples : _last;
+        memcpy(&(*_x)[2*(a - _first)], &tmp[2*(a - e.sample)], 4*(z - a));
+    }
+    return true;
+}
+
+// _n-th index entry of type _type, or NULL
+inline const noctar_index_entry *noctar_container_find(const noctar_container *_c,
+                                                       uint32_t _type,
+                                                       unsigned long long _n = 0)
+{
+    for (unsigned long long i=0; i<_c->index_count; i++) {
+        if (_c->index[i].type == _type && _n-- == 0)
+            return &_c->index[i];
+    }
+    return NULL;
+}
+
+// body sample holding raw sample _raw (for a decimated body, the first
+// body sample at or after it); false if it was dropped or is past the
+// end.  Runs are few (one per overflow), so they are scanned in order.
+inline bool noctar_container_body_sample(const noctar_container *_c,
+                                         unsigned long long _raw,
+                                         unsigned long long *_body)
+{
+    unsigned int D = _c->header->decimation;
+    if (D > 1) {
+        // the channelizer zero-fills gaps, so its grid has no runs
+        *_body = (_raw + D - 1) / D;
+        return *_body < _c->body_samples;
+    }
+
+    // without run entries the body is the raw stream
+    unsigned long long raw0 = 0, body0 = 0, body_end = _c->body_samples;
+    for (unsigned long long i=0; i<_c->index_count; i++) {
+        const noctar_index_entry &e = _c->index[i];
+        if (e.type != NOCTAR_INDEX_RUN)
+            continue;
+        if (e.sample > _raw) {
+            body_end = e.aux;
+            break;
+        }
+        raw0  = e.sample;
+        body0 = e.aux;
+    }
+    if (_raw < raw0)
+        return false;
+    *_body = body0 + (_raw - raw0);
+    return *_body < body_end;
+}
+
+// raw Noctar sample of body sample _body
+inline unsigned long long noctar_container_raw_sample(const noctar_container *_c,
+                                                      unsigned long long _body)
+{
+    unsigned int D = _c->header->decimation;
+    if (D > 1)
+        return _body * D;
+
+    unsigned long long raw0 = 0, body0 = 0;
+    for (unsigned long long i=0; i<_c->index_count; i++) {
+        const noctar_index_entry &e = _c->index[i];
+        if (e.type != NOCTAR_INDEX_RUN)
+            continue;
+        if (e.aux > _body)
+            break;
+        raw0  = e.sample;
+        body0 = e.aux;
+    }
+    return raw0 + (_body - body0);
+}
+
+#endif // __NOCTAR_CONTAINER_H__
@@ -0,0 +1,175 @@
+/*
+ * noctar_daemon.h
+ *
+ * Unix socket job channel for a long-lived packet_tx
+ *
+ * The daemon owns the usrp and /dev/langford and listens on a Unix
+ * stream socket.  A job is one connection carrying one line: the same
+ * options packet_tx takes on its command line, separated by whitespace
+ * (no quoting, so paths must not contain spaces).  The daemon runs the
+ * trial and answers with one line, "ok ..." or "error ...", then closes
+ * the connection.  Jobs run one at a time, in the order they connect.
+ */
+
+#ifndef __NOCTAR_DAEMON_H__
+#define __NOCTAR_DAEMON_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+
+#define NOCTAR_DAEMON_MAX_JOB 4096      // bytes in one job line
+#define NOCTAR_DAEMON_RECV_TIMEOUT 5    // seconds a client has to send its job
+
+inline bool noctar_daemon_address(struct sockaddr_un *_addr, const char *_path)
+{
+    memset(_addr, 0, sizeof(*_addr));
+    _addr->sun_family = AF_UNIX;
+    if (strlen(_path) >= sizeof(_addr->sun_path)) {
+        fprintf(stderr,"error: socket path '%s' is too long\n", _path);
+        return false;
+    }
+    strcpy(_addr->sun_path, _path);
+    return true;
+}
+
+// bind and listen on _path, replacing a stale socket; returns the
+// listening descriptor or -1
+inline int noctar_daemon_listen(const char *_path)
+{
+    struct sockaddr_un addr;
+    if (!noctar_daemon_address(&addr, _path))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        fprintf(stderr,"error: could not listen on '%s': %s\n", _path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// read one job line from the accepted connection _fd and split it
+// into _args; false if the peer sent nothing usable within
+// NOCTAR_DAEMON_RECV_TIMEOUT seconds, so a silent client cannot hold
+// up the jobs queued behind it
+inline bool noctar_daemon_recv_job(int _fd, std::vector<std::string> *_args)
+{
+    struct timeval tv = {NOCTAR_DAEMON_RECV_TIMEOUT, 0};
+    if (setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+        perror("setsockopt");
+
+    char line[NOCTAR_DAEMON_MAX_JOB];
+    size_t n = 0;
+    while (n < sizeof(line) - 1) {
+        ssize_t r = read(_fd, line + n, sizeof(line) - 1 - n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            fprintf(stderr,"error: could not read job: %s\n", strerror(errno));
+            return false;
+        }
+        if (r == 0)
+            break;
+        n += r;
+        if (memchr(line + n - r, '\n', r) != NULL)
+            break;
+    }
+    if (n == 0)
+        return false;
+    line[n] = '\0';
+    char *nl = strchr(line, '\n');
+    if (nl == NULL && n == sizeof(line) - 1) {
+        fprintf(stderr,"error: job line longer than %d bytes\n", NOCTAR_DAEMON_MAX_JOB - 1);
+        return false;
+    }
+    if (nl) *nl = '\0';
+
+    _args->clear();
+    for (char *tok = strtok(line, " \t\r"); tok != NULL; tok = strtok(NULL, " \t\r"))
+        _args->push_back(tok);
+    return true;
+}
+
+// write the whole of _s to the socket _fd; a peer that has gone away
+// fails the send instead of raising SIGPIPE
+inline bool noctar_daemon_send(int _fd, const std::string &_s)
+{
+    size_t n = 0;
+    while (n < _s.size()) {
+        ssize_t r = send(_fd, _s.data() + n, _s.size() - n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        n += r;
+    }
+    return true;
+}
+
+// argv-style view of _args (with _prog as argv[0]) for getopt; the
+// pointers stay valid while _args is not modified
+inline std::vector<char *> noctar_daemon_argv(const char *_prog, std::vector<std::string> &_args)
+{
+    std::vector<char *> argv;
+    argv.push_back((char*)_prog);
+    for (size_t i=0; i<_args.size(); i++)
+        argv.push_back(&_args[i][0]);
+    argv.push_back(NULL);
+    return argv;
+}
+
+// client side: send _argc arguments as one job to the daemon on _path
+// and copy its reply line to _reply; false if the daemon could not be
+// reached
+inline bool noctar_daemon_submit(const char *_path, int _argc, char **_argv, std::string *_reply)
+{
+    struct sockaddr_un addr;
+    if (!noctar_daemon_address(&addr, _path))
+        return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return false;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr,"error: could not reach daemon on '%s': %s\n", _path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    std::string job;
+    for (int i=0; i<_argc; i++) {
+        if (i > 0) job += " ";
+        job += _argv[i];
+    }
+    job += "\n";
+    bool ok = noctar_daemon_send(fd, job);
+
+    // the reply arrives once the trial is over
+    _reply->clear();
+    char buf[256];
+    ssize_t r;
+    while (ok && ((r = read(fd, buf, sizeof(buf))) > 0 || (r < 0 && errno == EINTR))) {
+        if (r > 0)
+            _reply->append(buf, r);
+    }
+    close(fd);
+    return ok;
+}
+
+#endif // __NOCTAR_DAEMON_H__
@@ -0,0 +1,335 @@
+/*
+ * noctar_decoder.h
+ *
+ * online frame64 decoding of the channelized capture
+ *
+ * The channelizer output (cshort at noctar_rate/D) is resampled to the
+ * usrp tx rate, so the frames arrive at the two samples per symbol
+ * framegen64 produced them at, and cut into segments.  Each segment
+ * starts with the last few frames' worth of samples of the previous
+ * one, so a frame crossing a boundary is seen whole by the next
+ * segment.  Segments are dealt round-robin to worker threads over
+ * single-producer/single-consumer rings; every worker runs its own
+ * framesync64, reset at the start of each segment.  A frame belongs
+ * to the segment whose own (non-overlap) part holds the feed block in
+ * which it was detected; the overlap is fed in blocks of its own, so
+ * every frame is reported exactly once.
+ *
+ * Frames are reported with header/payload validity, packet id (the
+ * first two header bytes, see tx_framegen.h), EVM, RSSI and carrier
+ * offset, and the raw Noctar sample index where the frame ended, to
+ * within one feed block.  A worker ring that is full when a segment is
+ * ready drops the segment (counted) rather than stalling the writer.
+ */
+
+#ifndef __NOCTAR_DECODER_H__
+#define __NOCTAR_DECODER_H__
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <complex>
+#include <vector>
+#include <algorithm>
+#include <ostream>
+#include <liquid/liquid.h>
+
+#define FRAME_DECODER_SEGMENT   (32*FRAME64_LEN)    // owned samples per segment
+#define FRAME_DECODER_OVERLAP   (2*FRAME64_LEN)     // samples repeated from the last one
+#define FRAME_DECODER_BLOCK     64                  // samples per framesync64_execute()
+#define FRAME_DECODER_RING      16                  // segments queued per worker
+
+struct frame_decode_result {
+    double raw_index;           // raw Noctar sample where the frame ended
+    unsigned long long index;   // decoder-rate sample where it ended
+    bool header_valid;
+    bool payload_valid;
+    unsigned int pid;           // packet id (valid with the header)
+    float evm;                  // [dB]
+    float rssi;                 // [dB]
+    float cfo;                  // carrier offset [f/Fs]
+};
+
+inline bool frame_decode_result_before(const frame_decode_result &_a, const frame_decode_result &_b)
+{
+    return _a.index < _b.index;
+}
+
+struct frame_decoder_segment {
+    unsigned long long first;   // decoder-rate index of samples[0]
+    unsigned long long owned;   // first index this segment reports
+    std::vector<std::complex<float> > samples;
+};
+
+struct frame_decoder;
+
+struct frame_decoder_worker {
+    frame_decoder *decoder;
+    framesync64 fs;
+
+    // ring of segments from the producer
+    frame_decoder_segment *ring[FRAME_DECODER_RING];
+    unsigned int head;          // stored by the producer only
+    unsigned int tail;          // stored by the worker only
+
+    // callback state
+    unsigned long long pos;     // index one past the last sample fed
+    unsigned long long owned;
+    std::vector<frame_decode_result> results;
+
+    pthread_t thread;
+};
+
+struct frame_decoder {
+    // decoder-rate sample j is channel sample j/ratio, which is raw
+    // sample (j/ratio)*decim - delay
+    double ratio;               // decoder rate / channel rate
+    unsigned int decim;
+    double delay;               // channelizer delay [raw samples]
+
+    // resampler state (producer)
+    double t;                   // channel index of the next output
+    unsigned long long in_count;    // channel samples seen
+    std::complex<float> prev;   // last channel sample of the previous push
+    unsigned long long out_count;   // decoder-rate samples produced
+
+    frame_decoder_segment *cur; // segment being filled
+    unsigned int next_worker;
+
+    std::vector<frame_decoder_worker> workers;
+    int closed;
+
+    // counters
+    unsigned long long segments;
+    unsigned long long dropped_segments;
+};
+
+inline int frame_decoder_callback(unsigned char *_header,
+                                  int _header_valid,
+                                  unsigned char *_payload,
+                                  unsigned int _payload_len,
+                                  int _payload_valid,
+                                  framesyncstats_s _stats,
+                                  void *_userdata)
+{
+    (void)_payload;
+    (void)_payload_len;
+    frame_decoder_worker *w = (frame_decoder_worker*)_userdata;
+    // blocks never straddle owned, so the block's last sample decides
+    if (w->pos <= w->owned)
+        return 0;
+
+    const frame_decoder *d = w->decoder;
+    frame_decode_result r;
+    r.index         = w->pos;
+    r.raw_index     = w->pos / d->ratio * d->decim - d->delay;
+    r.header_valid  = _header_valid != 0;
+    r.payload_valid = _payload_valid != 0;
+    r.pid           = _header_valid ? ((unsigned int)_header[0] << 8) | _header[1] : 0;
+    r.evm           = _stats.evm;
+    r.rssi          = _stats.rssi;
+    r.cfo           = _stats.cfo;
+    w->results.push_back(r);
+    return 0;
+}
+
+inline void *frame_decoder_thread(void *_arg)
+{
+    frame_decoder_worker *w = (frame_decoder_worker*)_arg;
+    while (true) {
+        unsigned int head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+        if (w->tail == head) {
+            if (__atomic_load_n(&w->decoder->closed, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == w->tail)
+                break;
+            struct timespec ts = {0, 200000};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        frame_decoder_segment *s = w->ring[w->tail % FRAME_DECODER_RING];
+        framesync64_reset(w->fs);
+        w->owned = s->owned;
+        size_t n = s->samples.size();
+        size_t cut = s->owned > s->first ? s->owned - s->first : 0;
+        if (cut > n)
+            cut = n;
+        // the overlap and the owned part are fed as separate runs of
+        // blocks, so no block holds samples of both
+        for (size_t i=0; i<n; ) {
+            size_t end = i < cut ? cut : n;
+            unsigned int k = end - i < FRAME_DECODER_BLOCK ? end - i : FRAME_DECODER_BLOCK;
+            w->pos = s->first + i + k;
+            framesync64_execute(w->fs, &s->samples[i], k);
+            i += k;
+        }
+        delete s;
+        __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// start _num_threads decoders for a channel stream at _channel_rate
+// (decimated by _decim with _delay raw samples of delay) carrying frames
+// sent at _tx_rate
+inline bool frame_decoder_start(frame_decoder *_d,
+                                double _channel_rate,
+                                double _tx_rate,
+                                unsigned int _decim,
+                                double _delay,
+                                unsigned int _num_threads)
+{
+    if (_num_threads == 0 || _channel_rate <= 0.0 || _tx_rate <= 0.0) {
+        fprintf(stderr,"error: frame_decoder_start(), need threads and sample rates\n");
+        return false;
+    }
+    // the resampler only decimates: a channel slower than the tx rate
+    // has already lost (or aliased) part of the burst
+    if (_tx_rate > _channel_rate) {
+        fprintf(stderr,"error: frame_decoder_start(), channel rate %.0f below the tx rate %.0f, lower channel_decim\n",
+                _channel_rate, _tx_rate);
+        return false;
+    }
+    _d->ratio = _tx_rate / _channel_rate;
+    _d->decim = _decim;
+    _d->delay = _delay;
+    _d->t         = 0.0;
+    _d->in_count  = 0;
+    _d->prev      = 0.0f;
+    _d->out_count = 0;
+    _d->cur         = NULL;
+    _d->next_worker = 0;
+    _d->closed = 0;
+    _d->segments         = 0;
+    _d->dropped_segments = 0;
+
+    // workers never move once started: they are handed their own address
+    _d->workers.resize(_num_threads);
+    for (unsigned int i=0; i<_num_threads; i++) {
+        frame_decoder_worker &w = _d->workers[i];
+        w.decoder = _d;
+        w.head = 0;
+        w.tail = 0;
+        w.pos   = 0;
+        w.owned = 0;
+        w.fs = framesync64_create(frame_decoder_callback, (void*)&w);
+        if (pthread_create(&w.thread, NULL, frame_decoder_thread, (void*)&w) != 0) {
+            fprintf(stderr,"error: frame_decoder_start(), could not create decoder thread\n");
+            framesync64_destroy(w.fs);
+            __atomic_store_n(&_d->closed, 1, __ATOMIC_RELEASE);
+            for (unsigned int j=0; j<i; j++) {
+                pthread_join(_d->workers[j].thread, NULL);
+                framesync64_destroy(_d->workers[j].fs);
+            }
+            _d->workers.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+// hand the current segment to the next worker, and start a new one
+// holding its last FRAME_DECODER_OVERLAP samples
+inline void frame_decoder_dispatch(frame_decoder *_d)
+{
+    frame_decoder_segment *s = _d->cur;
+    frame_decoder_segment *next = new frame_decoder_segment;
+    size_t n = s->samples.size();
+    size_t keep = n < FRAME_DECODER_OVERLAP ? n : FRAME_DECODER_OVERLAP;
+    next->first = s->first + n - keep;
+    next->owned = s->first + n;
+    next->samples.reserve(FRAME_DECODER_OVERLAP + FRAME_DECODER_SEGMENT);
+    next->samples.assign(s->samples.end() - keep, s->samples.end());
+    _d->cur = next;
+
+    frame_decoder_worker &w = _d->workers[_d->next_worker];
+    _d->next_worker = (_d->next_worker + 1) % _d->workers.size();
+    _d->segments++;
+    if (w.head - __atomic_load_n(&w.tail, __ATOMIC_ACQUIRE) >= FRAME_DECODER_RING) {
+        _d->dropped_segments++;
+        delete s;
+        return;
+    }
+    w.ring[w.head % FRAME_DECODER_RING] = s;
+    __atomic_store_n(&w.head, w.head + 1, __ATOMIC_RELEASE);
+}
+
+// feed _n channel samples (interleaved cshort); called by the producer
+// (the capture writer) only
+inline void frame_decoder_push(frame_decoder *_d, const short *_x, size_t _n)
+{
+    if (_d->cur == NULL) {
+        _d->cur = new frame_decoder_segment;
+        _d->cur->first = 0;
+        _d->cur->owned = 0;
+        _d->cur->samples.reserve(FRAME_DECODER_OVERLAP + FRAME_DECODER_SEGMENT);
+    }
+
+    // linear interpolation onto the tx sample grid; channel sample
+    // in_count-1 is prev, in_count+i is _x[i]
+    double step = 1.0 / _d->ratio;
+    double b = (double)_d->in_count;
+    while (true) {
+        double i0 = floor(_d->t);
+        long k = (long)(i0 - b);        // -1 .. _n-2
+        if (k + 1 >= (long)_n)
+            break;                      // x1 arrives with the next push
+        float frac = (float)(_d->t - i0);
+        std::complex<float> x0 = k < 0 ? _d->prev : std::complex<float>(_x[2*k], _x[2*k+1]);
+        std::complex<float> x1(_x[2*k+2], _x[2*k+3]);
+        _d->cur->samples.push_back(x0 + frac*(x1 - x0));
+        _d->out_count++;
+        _d->t += step;
+        if (_d->cur->samples.size() >= FRAME_DECODER_OVERLAP + FRAME_DECODER_SEGMENT ||
+            (_d->cur->owned == 0 && _d->cur->samples.size() >= FRAME_DECODER_SEGMENT))
+            frame_decoder_dispatch(_d);
+    }
+    if (_n > 0)
+        _d->prev = std::complex<float>(_x[2*(_n-1)], _x[2*(_n-1)+1]);
+    _d->in_count += _n;
+}
+
+// decode what is left, stop the workers and return all frames in order
+inline void frame_decoder_stop(frame_decoder *_d, std::vector<frame_decode_result> *_frames)
+{
+    if (_d->cur != NULL && _d->cur->samples.size() > (_d->cur->owned > _d->cur->first ? _d->cur->owned - _d->cur->first : 0))
+        frame_decoder_dispatch(_d);
+    delete _d->cur;
+    _d->cur = NULL;
+
+    __atomic_store_n(&_d->closed, 1, __ATOMIC_RELEASE);
+    _frames->clear();
+    for (unsigned int i=0; i<_d->workers.size(); i++) {
+        frame_decoder_worker &w = _d->workers[i];
+        pthread_join(w.thread, NULL);
+        framesync64_destroy(w.fs);
+        _frames->insert(_frames->end(), w.results.begin(), w.results.end());
+    }
+    std::sort(_frames->begin(), _frames->end(), frame_decode_result_before);
+}
+
+// summary line, then one line per frame
+inline void frame_decoder_write(std::ostream &_os,
+                                const frame_decoder *_d,
+                                const std::vector<frame_decode_result> &_frames)
+{
+    unsigned int headers = 0, payloads = 0;
+    for (size_t i=0; i<_frames.size(); i++) {
+        headers  += _frames[i].header_valid;
+        payloads += _frames[i].payload_valid;
+    }
+    _os << "rx frames: " << _frames.size() << " header valid: " << headers << " payload valid: " << payloads
+        << " decoder rate ratio: " << _d->ratio << " segments: " << _d->segments
+        << " dropped segments: " << _d->dropped_segments << std::endl;
+    for (size_t i=0; i<_frames.size(); i++) {
+        const frame_decode_result &r = _frames[i];
+        _os << "rx frame: " << i << " raw sample: " << (long long)r.raw_index
+            << " header: " << (r.header_valid ? "ok" : "bad")
+            << " payload: " << (r.payload_valid ? "ok" : "bad")
+            << " pid: " << r.pid << " evm: " << r.evm << " rssi: " << r.rssi
+            << " cfo: " << r.cfo << std::endl;
+    }
+}
+
+#endif // __NOCTAR_DECODER_H__
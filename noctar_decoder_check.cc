@@ -0,0 +1,130 @@
+/*
+ * noctar_decoder_check.cc
+ *
+ * segment boundary check of the online frame decoder in noctar_decoder.h
+ *
+ * Places a frame64 frame every N samples of a synthetic channel stream,
+ * long enough to cross many decoder segment boundaries at every offset
+ * into the 64-sample feed blocks, pushes it through frame_decoder in
+ * uneven pieces and checks that every packet id comes out exactly once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <complex>
+#include <vector>
+#include <liquid/liquid.h>
+
+#include "tx_framegen.h"
+#include "noctar_decoder.h"
+
+void usage() {
+    printf("noctar_decoder_check -- check that decoded frames are reported once\n");
+    printf("\n");
+    printf("  u,h   : usage/help\n");
+    printf("  n     : number of frames, default: 2000\n");
+    printf("  s     : frame spacing [samples], default: 1377 (frame64 + 37)\n");
+    printf("  p     : samples per push, default: 4093\n");
+    printf("  j     : number of decoder threads, default: number of cpus\n");
+}
+
+// most segments waiting in any one worker ring
+unsigned int queued_segments(const frame_decoder *_d)
+{
+    unsigned int queued = 0;
+    for (unsigned int i=0; i<_d->workers.size(); i++) {
+        const frame_decoder_worker &w = _d->workers[i];
+        unsigned int q = w.head - __atomic_load_n(&w.tail, __ATOMIC_ACQUIRE);
+        if (q > queued)
+            queued = q;
+    }
+    return queued;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned int num_frames = 2000;
+    unsigned int spacing = FRAME64_LEN + 37;
+    unsigned int push = 4093;
+    unsigned int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int d;
+    while ((d = getopt(argc,argv,"uhn:s:p:j:")) != EOF) {
+        switch (d) {
+        case 'u':
+        case 'h':   usage();                            return 0;
+        case 'n':   num_frames  = atoi(optarg);         break;
+        case 's':   spacing     = atoi(optarg);         break;
+        case 'p':   push        = atoi(optarg);         break;
+        case 'j':   num_threads = atoi(optarg);         break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (num_frames == 0 || num_frames > TX_FRAMEGEN_MAX_DISTINCT || spacing < FRAME64_LEN || push == 0) {
+        fprintf(stderr,"error: %s, need 1..%u frames, a spacing of at least %u samples and a push size\n",
+                argv[0], TX_FRAMEGEN_MAX_DISTINCT, FRAME64_LEN);
+        exit(1);
+    }
+
+    // frame n (packet id n) ends at sample (n+2)*spacing; the stream
+    // starts with a frame's worth of silence for the synchronizer
+    std::vector<std::complex<float> > frames((size_t)num_frames*FRAME64_LEN);
+    tx_framegen_library(&frames[0], num_frames, 1.0f, 1, num_threads);
+    size_t num_samples = (size_t)(num_frames + 2)*spacing;
+    std::vector<short> x(2*num_samples, 0);
+    for (unsigned int n=0; n<num_frames; n++) {
+        size_t base = (size_t)(n + 2)*spacing - FRAME64_LEN;
+        for (unsigned int i=0; i<FRAME64_LEN; i++) {
+            x[2*(base+i)]   = (short)(8192.0f*frames[(size_t)n*FRAME64_LEN + i].real());
+            x[2*(base+i)+1] = (short)(8192.0f*frames[(size_t)n*FRAME64_LEN + i].imag());
+        }
+    }
+
+    // channel at the tx rate: the resampler passes samples through
+    frame_decoder decoder;
+    if (!frame_decoder_start(&decoder, 1.0, 1.0, 1, 0.0, num_threads))
+        exit(1);
+    for (size_t off=0; off<num_samples; off+=push) {
+        size_t n = num_samples - off < push ? num_samples - off : push;
+        frame_decoder_push(&decoder, &x[2*off], n);
+        // let the workers keep up rather than dropping segments
+        while (queued_segments(&decoder) >= FRAME_DECODER_RING / 2)
+            usleep(1000);
+    }
+    std::vector<frame_decode_result> rx;
+    frame_decoder_stop(&decoder, &rx);
+
+    std::vector<unsigned int> count(num_frames, 0);
+    unsigned int other = 0;
+    for (size_t i=0; i<rx.size(); i++) {
+        if (rx[i].header_valid && rx[i].pid < num_frames)
+            count[rx[i].pid]++;
+        else
+            other++;
+    }
+    unsigned int missing = 0, repeated = 0;
+    for (unsigned int n=0; n<num_frames; n++) {
+        if (count[n] == 0)
+            missing++;
+        else if (count[n] > 1)
+            repeated++;
+    }
+
+    printf("frames      :   %u\n", num_frames);
+    printf("spacing     :   %u\n", spacing);
+    printf("segments    :   %llu (%llu dropped)\n", decoder.segments, decoder.dropped_segments);
+    printf("reported    :   %zu\n", rx.size());
+    printf("missing     :   %u\n", missing);
+    printf("repeated    :   %u\n", repeated);
+    printf("unknown     :   %u\n", other);
+
+    bool ok = missing == 0 && repeated == 0 && other == 0 && decoder.dropped_segments == 0;
+    if (!ok)
+        printf("error: frames were not reported exactly once\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,32 @@
+/*
+ * noctar_futex.h
+ *
+ * futex wait/wake on a sequence word
+ *
+ * Parked helper threads (tx worker, compression workers) sleep on a
+ * counter that their producer bumps, with no mutex or condition
+ * variable in between: a waiter only sleeps while the word still holds
+ * the value it last saw, so a bump between its check and the wait is
+ * never lost.
+ */
+
+#ifndef __NOCTAR_FUTEX_H__
+#define __NOCTAR_FUTEX_H__
+
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// sleep while *_addr == _val (returns at once if it already differs)
+inline void noctar_futex_wait(unsigned int *_addr, unsigned int _val)
+{
+    syscall(SYS_futex, _addr, FUTEX_WAIT_PRIVATE, _val, NULL, NULL, 0);
+}
+
+// wake up to _n threads sleeping on _addr
+inline void noctar_futex_wake(unsigned int *_addr, int _n = 1)
+{
+    syscall(SYS_futex, _addr, FUTEX_WAKE_PRIVATE, _n, NULL, NULL, 0);
+}
+
+#endif // __NOCTAR_FUTEX_H__
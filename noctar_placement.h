@@ -0,0 +1,187 @@
+/*
+ * noctar_placement.h
+ *
+ * cpu pinning, NUMA placement and memory locking
+ *
+ * Each thread on the measured path (Noctar reader, capture writer, tx
+ * worker, async monitor) can be pinned to its own cpu.  The buffers a
+ * thread hammers are then moved to the NUMA node of that cpu with
+ * mbind(MPOL_PREFERRED, MPOL_MF_MOVE), called directly so there is no
+ * libnuma dependency; on a single-node machine (or a kernel without
+ * NUMA) this is a no-op.  Node numbers come from sysfs, and the node a
+ * buffer actually landed on is read back with get_mempolicy() so the
+ * startup report shows the resulting placement, not the request.
+ */
+
+#ifndef __NOCTAR_PLACEMENT_H__
+#define __NOCTAR_PLACEMENT_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <string>
+
+// NUMA node of _cpu, or -1 if unknown (no sysfs entry, no NUMA)
+inline int placement_cpu_node(int _cpu)
+{
+    if (_cpu < 0)
+        return -1;
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", _cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+    int node = -1;
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+        if (strncmp(e->d_name, "node", 4) == 0 && sscanf(e->d_name + 4, "%d", &node) == 1)
+            break;
+    }
+    closedir(dir);
+    return node;
+}
+
+// pin _thread to _cpu (-1: leave it alone)
+inline bool placement_pin(pthread_t _thread, int _cpu, const char *_name)
+{
+    if (_cpu < 0)
+        return true;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(_cpu, &set);
+    int ret = pthread_setaffinity_np(_thread, sizeof(set), &set);
+    if (ret != 0) {
+        fprintf(stderr,"warning: %s could not be pinned to cpu %d (%s)\n", _name, _cpu, strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+// keep _thread off _cpu (-1: leave it alone), for helpers that must not
+// share a cpu with a SCHED_FIFO thread pinned there; a thread that may
+// only run on _cpu is left where it is
+inline bool placement_avoid(pthread_t _thread, int _cpu, const char *_name)
+{
+    if (_cpu < 0)
+        return true;
+    cpu_set_t set;
+    if (pthread_getaffinity_np(_thread, sizeof(set), &set) != 0)
+        return false;
+    CPU_CLR(_cpu, &set);
+    if (CPU_COUNT(&set) == 0) {
+        fprintf(stderr,"warning: %s has no cpu besides %d to run on\n", _name, _cpu);
+        return false;
+    }
+    int ret = pthread_setaffinity_np(_thread, sizeof(set), &set);
+    if (ret != 0) {
+        fprintf(stderr,"warning: %s could not be moved off cpu %d (%s)\n", _name, _cpu, strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+// cpus _thread may run on, as a list like "2" or "0-7"
+inline std::string placement_thread_cpus(pthread_t _thread)
+{
+    cpu_set_t set;
+    if (pthread_getaffinity_np(_thread, sizeof(set), &set) != 0)
+        return "?";
+    std::string s;
+    char buf[32];
+    for (int c=0; c<CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, &set))
+            continue;
+        int last = c;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set))
+            last++;
+        if (last > c) snprintf(buf, sizeof(buf), "%s%d-%d", s.empty() ? "" : ",", c, last);
+        else          snprintf(buf, sizeof(buf), "%s%d", s.empty() ? "" : ",", c);
+        s += buf;
+        c = last;
+    }
+    return s;
+}
+
+// prefer node _node for the pages of [_addr, _addr+_bytes) and move any
+// already touched there (-1: leave them alone)
+inline bool placement_bind(void *_addr, size_t _bytes, int _node)
+{
+    if (_node < 0 || _addr == NULL || _bytes == 0)
+        return true;
+    if (_node >= (int)(8*sizeof(unsigned long))) {
+        fprintf(stderr,"warning: placement_bind(), node %d out of range\n", _node);
+        return false;
+    }
+
+    // mbind wants a page-aligned start
+    size_t page  = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)_addr & ~(page - 1);
+    size_t len   = (size_t)_addr + _bytes - start;
+    unsigned long mask = 1ul << _node;
+    if (syscall(SYS_mbind, start, len, MPOL_PREFERRED, &mask, 8*sizeof(mask), MPOL_MF_MOVE) != 0) {
+        // ENOSYS: kernel without NUMA; nothing to place
+        if (errno != ENOSYS)
+            fprintf(stderr,"warning: placement_bind(), mbind to node %d: %s\n", _node, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// node holding the (touched) page at _addr, or -1 if unknown
+inline int placement_memory_node(const void *_addr)
+{
+    if (_addr == NULL)
+        return -1;
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, _addr, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+        return -1;
+    return node;
+}
+
+// cpus and scheduling of a thread, to undo a pin and a priority change
+struct placement_saved {
+    cpu_set_t cpus;
+    int policy;
+    struct sched_param param;
+    bool have_cpus;
+    bool have_sched;
+};
+
+inline void placement_save(pthread_t _thread, placement_saved *_s)
+{
+    _s->have_cpus  = pthread_getaffinity_np(_thread, sizeof(_s->cpus), &_s->cpus) == 0;
+    _s->have_sched = pthread_getschedparam(_thread, &_s->policy, &_s->param) == 0;
+}
+
+// put back what placement_save() recorded
+inline bool placement_restore(pthread_t _thread, const placement_saved *_s, const char *_name)
+{
+    bool ok = true;
+    if (_s->have_sched && pthread_setschedparam(_thread, _s->policy, &_s->param) != 0)
+        ok = false;
+    if (_s->have_cpus && pthread_setaffinity_np(_thread, sizeof(_s->cpus), &_s->cpus) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr,"warning: %s could not get its cpus and scheduling back\n", _name);
+    return ok;
+}
+
+// lock current and future pages; _error gets errno on failure
+inline bool placement_mlockall(int *_error)
+{
+    *_error = 0;
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        *_error = errno;
+        return false;
+    }
+    return true;
+}
+
+#endif // __NOCTAR_PLACEMENT_H__
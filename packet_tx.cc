@@ -34,29 +34,127 @@
 #include <typeinfo>
 
 #include <uhd/usrp/multi_usrp.hpp>
+#include <uhd/exception.hpp>
 
 #include <fstream>
+#include <sstream>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <pthread.h>
 
+#include "noctar_capture.h"
+#include "noctar_config.h"
+#include "tx_waveform.h"
+#include "tx_framegen.h"
+#include "tx_schedule.h"
+#include "capture_sweep.h"
+#include "burst_detector.h"
+#include "tx_worker.h"
+#include "tx_async.h"
+#include "tx_timestamps.h"
+#include "noctar_daemon.h"
+#include "noctar_placement.h"
+#include "noctar_channelizer.h"
+#include "noctar_decoder.h"
+#include "noctar_container.h"
+#include "noctar_compress.h"
+
 struct transmit_arg_struct {
-    unsigned int num_frames;
     uhd::tx_streamer::sptr tx_stream;
-    std::vector<std::vector<std::complex<float> *> > buffs_vec;
+    const tx_waveform *waveform;    // pre-built burst
+    double tx_rate;                 // actual usrp tx rate [samples/s]
     uhd::tx_metadata_t md;
-    bool *finished_transmitting; 
     bool verbose;
     uhd::usrp::multi_usrp::sptr usrp;
+    tx_event_log *events;       // send/EOB timestamps
+
+    // timed burst: first send carries a time_spec at at_time, or (lead
+    // > 0) this far ahead of the usrp clock
+    double at_time;             // absolute usrp time [s] (<0: none)
+    double lead;
+    double armed_time;          // usrp time when the burst was armed [s]
+    double scheduled_time;      // usrp time the burst is scheduled for [s]
+    uint64_t armed_ns;          // CLOCK_MONOTONIC_RAW when armed
+
+    // retune before the burst with timed commands (tx_burst_retunes)
+    double frequency;           // center frequency [Hz] (0: keep)
+    double uhd_gain;            // uhd tx gain [dB] (NAN: keep)
+    double retune_guard;        // commands apply this far ahead of the usrp clock [s]
+
+    // result
+    uint64_t send_ns;           // first send() call to EOB return
+    double command_time;        // usrp time the commands apply [s]
+    double lock_time;           // usrp time the lo was seen locked [s] (0: not seen)
+    uint64_t retune_ns;         // host time spent issuing the commands
+};
+
+// everything one trial needs from the command line (or a daemon job)
+struct packet_tx_options {
+    bool verbose;
+    double frequency;                   // center frequency [Hz]
+    double bandwidth;
+    unsigned int num_frames;            // number of frames to transmit
+    double txgain_dB;                   // software tx gain [dB]
+    double uhd_txgain;                  // uhd (hardware) tx gain
+    unsigned int num_distinct;          // distinct frames (0: num_frames)
+    unsigned int framegen_threads;
+    std::string cpu_format;             // host sample format
+    std::string otw_format;             // over-the-wire format ("": uhd default)
+    unsigned int packets_per_send;      // send() size in max_num_samps units
+    double tx_lead;                     // timed burst lead [s] (0: send now)
+    std::string schedule_file;          // burst schedule ("": one burst)
+    std::string sweep_spec;             // frequency sweep f0:f1:step ("": none)
+    double retune_guard;                // timed command lead [s]
+    std::string output;                 // capture file, log at <output>.log
+    std::string listen_socket;          // run as a daemon on this socket
+    std::string submit_socket;          // hand the job to the daemon here
+    bool sweep;                         // run the read-size sweep and exit
+    bool help;
+
+    // capture settings (read size, chunk size, ring depth, alignment)
+    capture_config capture_cfg;
+};
+
+// device state that outlives a trial: a daemon opens the usrp, its tx
+// streamer and /dev/langford once and re-applies a setting only when a
+// job asks for a different one
+struct packet_tx_session {
+    uhd::usrp::multi_usrp::sptr usrp;
+    int fd_read;                        // /dev/langford
+    uhd::tx_streamer::sptr tx_stream;
+    std::string cpu_format;             // formats of tx_stream
+    std::string otw_format;
+    double bandwidth;                   // applied settings (0/NAN: unknown)
+    double frequency;
+    double uhd_txgain;
+    double usrp_tx_rate;                // actual usrp tx rate [samples/s]
+    bool mlocked;                       // mlockall() succeeded
+    int mlock_error;                    // its errno otherwise
 };
 
 //void transmit(unsigned int num_frames, uhd::tx_streamer::sptr tx_stream, std::vector<std::vector<std::complex<float> *> > buffs_vec, uhd::tx_metadata_t md, bool verbose);
 void *transmit(void *args);
 
+// channelizer feeding the frame decoder (NULL: channelize only)
+struct channel_decode_arg_struct {
+    channelizer *chan;
+    frame_decoder *decoder;
+};
+const char *channel_decode_process(void *ctx, const char *buf, size_t n,
+                                   unsigned long long offset, size_t *out_n);
+bool retune(transmit_arg_struct *args);
+
 void set_realtime_priority();
 
+void packet_tx_options_init(packet_tx_options *_o);
+bool packet_tx_parse(packet_tx_options *_o, int _argc, char **_argv);
+bool packet_tx_configure(packet_tx_session *_s, const packet_tx_options *_o);
+bool packet_tx_trial(packet_tx_session *_s, const packet_tx_options *_o);
+
+const unsigned long int DAC_RATE = 64e6;
+
 void usage() {
     printf("packet_tx -- transmit simple packets\n");
     printf("\n");
@@ -67,111 +165,374 @@ void usage() {
     printf("  g     : software tx gain [dB] (default: -6dB)\n");
     printf("  G     : uhd tx gain [dB] (default: 40dB)\n");
     printf("  N     : number of frames, default: 2000\n");
+    printf("  L     : number of distinct frames (packet ids 0..L-1), repeated to fill N, default: N, at most 65536\n");
+    printf("  j     : threads generating the frames, default: number of cpus\n");
+    printf("  F     : host (cpu) sample format: fc32, sc16, sc8, default: fc32\n");
+    printf("  O     : over-the-wire sample format: sc16, sc8, default: uhd default (sc16)\n");
+    printf("  S     : usrp packets per send() call (0: whole burst in one call), default: 1\n");
+    printf("  T     : schedule the burst this far ahead of the usrp clock [s] (0: send now), default: 0\n");
+    printf("  B     : burst schedule file, lines of '<gap samples | @usrp time> [frames [gain_dB [repeat]]] [f=<Hz>] [G=<dB>]'\n");
+    printf("  X     : frequency sweep f0:f1:step [Hz], repeats the schedule once per frequency\n");
+    printf("  o     : capture file (log at <file>.log), default: ./noctar_samples\n");
+    printf("          a container (header, samples, index) unless -K container=0\n");
+    printf("  s     : daemon: keep the usrp and /dev/langford open, run jobs from this unix socket\n");
+    printf("  J     : submit the other options as a job to the daemon on this socket\n");
+    printf("  R     : retune guard, timed tune/gain commands apply this far ahead [s], default: 0.01\n");
+    printf("  c     : capture config file (key = value), options after -c override it\n");
+    printf("  K     : one capture config key=value, e.g. reader_cpu=2, writer_cpu=3, async_cpu=5, mlock=0,\n");
+    printf("          channel_decim=64 (store only the tx channel, decimated; noctar_rate/channel_decim must\n");
+    printf("          be at least the tx rate, 4*bandwidth), noctar_center=<Hz>,\n");
+    printf("          decode_threads=2 (decode frame64 packets from the channel, log per-frame results)\n");
+    printf("  r     : samples per /dev/langford read, default: 100\n");
+    printf("  C     : capture chunk size [KiB] handed to the writer, default: 4096\n");
+    printf("  n     : number of chunks in the writer ring, default: 16\n");
+    printf("  A     : capture chunk alignment [bytes], default: page size\n");
+    printf("  D     : direct i/o capture writer, number of writes in flight (0: off), default: 0\n");
+    printf("  d     : burst detector window [samples] (0: off), default: 0\n");
+    printf("  t     : burst detector onset/end power ratio threshold, default: 10\n");
+    printf("  P     : pin the transmit worker to this cpu (it then busy-waits), default: none\n");
+    printf("  w     : sweep read sizes, report throughput and jitter, then exit\n");
 }
 
 int main (int argc, char **argv)
 {
     // command-line options
-    bool verbose = true;
-
-    unsigned long int DAC_RATE = 64e6;
-    double min_bandwidth = 0.25*(DAC_RATE / 512.0);
-    double max_bandwidth = 0.25*(DAC_RATE /   4.0);
+    packet_tx_options opts;
+    packet_tx_options_init(&opts);
+    if (!packet_tx_parse(&opts, argc, argv))
+        exit(1);
+    if (opts.help) {
+        usage();
+        return 0;
+    }
 
-    double frequency = 462.0e6;
-    double bandwidth = 250e3f;
-    unsigned int num_frames = 2000;     // number of frames to transmit
-    double txgain_dB = -12.0f;          // software tx gain [dB]
-    double uhd_txgain = 40.0;           // uhd (hardware) tx gain
+    // hand the job to a running daemon, which already has the device open
+    if (!opts.submit_socket.empty()) {
+        std::string reply;
+        if (!noctar_daemon_submit(opts.submit_socket.c_str(), argc-1, argv+1, &reply))
+            exit(1);
+        printf("%s", reply.c_str());
+        return reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+    }
 
-    //
-    int d;
-    while ((d = getopt(argc,argv,"uhqvf:b:g:G:N:")) != EOF) {
-        switch (d) {
-        case 'u':
-        case 'h':   usage();                        return 0;
-        case 'q':   verbose     = false;            break;
-        case 'v':   verbose     = true;             break;
-        case 'f':   frequency   = atof(optarg);     break;
-        case 'b':   bandwidth   = atof(optarg);     break;
-        case 'g':   txgain_dB   = atof(optarg);     break;
-        case 'G':   uhd_txgain  = atof(optarg);     break;
-        case 'N':   num_frames  = atoi(optarg);     break;
-        default:
-            usage();
-            return 0;
-        }
+    // sweep capture read sizes without touching the usrp
+    if (opts.sweep) {
+        FILE *sweep_log = fopen("./noctar_sweep.log", "w");
+        bool ok = capture_sweep(&opts.capture_cfg, "/dev/langford", opts.output.c_str(), sweep_log);
+        if (sweep_log) fclose(sweep_log);
+        return ok ? 0 : 1;
     }
 
-    if (bandwidth > max_bandwidth) {
-        fprintf(stderr,"error: %s, maximum bandwidth exceeded (%8.4f MHz)\n", argv[0], max_bandwidth*1e-6);
-        return 0;
-    } else if (bandwidth < min_bandwidth) {
-        fprintf(stderr,"error: %s, minimum bandwidth exceeded (%8.4f kHz)\n", argv[0], min_bandwidth*1e-3);
-        exit(1);
+    // lock everything before the device and buffers are set up, so
+    // nothing on the measured path can page-fault from swap
+    packet_tx_session session;
+    session.mlocked     = false;
+    session.mlock_error = 0;
+    if (opts.capture_cfg.mlock) {
+        session.mlocked = placement_mlockall(&session.mlock_error);
+        printf("mlockall    :   %s\n", session.mlocked ? "ok" : strerror(session.mlock_error));
     }
 
     uhd::device_addr_t dev_addr;
     //dev_addr["addr0"] = "192.168.10.2";
     //dev_addr["addr1"] = "192.168.10.3";
-    uhd::usrp::multi_usrp::sptr usrp = uhd::usrp::multi_usrp::make(dev_addr);
-
-    // set properties
-    double tx_rate = 4.0*bandwidth;
-
-    // NOTE : the sample rate computation MUST be in double precision so
-    //        that the UHD can compute its interpolation rate properly
-    unsigned int interp_rate = (unsigned int)(DAC_RATE / tx_rate);
-    // ensure multiple of 4
-    interp_rate = (interp_rate >> 2) << 2;
-    // NOTE : there seems to be a bug where if the interp rate is equal to
-    //        240 or 244 we get some weird warning saying that
-    //        "The hardware does not support the requested TX sample rate"
-    while (interp_rate == 240 || interp_rate == 244)
-        interp_rate -= 4;
-    // compute usrp sampling rate
-    double usrp_tx_rate = DAC_RATE / (double)interp_rate;
-    
-    // try to set tx rate
-    usrp->set_tx_rate(DAC_RATE / interp_rate);
+    session.usrp = uhd::usrp::multi_usrp::make(dev_addr);
+    session.bandwidth    = 0.0;
+    session.frequency    = NAN;
+    session.uhd_txgain   = NAN;
+    session.usrp_tx_rate = 0.0;
+
+    // open noctar device
+    session.fd_read = open("/dev/langford", O_RDONLY);
+    if (session.fd_read < 0) {
+        perror("open /dev/langford");
+        exit(1);
+    }
+
+    // print frame generator
+    framegen64 fg = framegen64_create();
+    framegen64_print(fg);
+    framegen64_destroy(fg);
+
+    if (opts.listen_socket.empty()) {
+        bool ok = packet_tx_configure(&session, &opts) && packet_tx_trial(&session, &opts);
+        close(session.fd_read);
+        return ok ? 0 : 1;
+    }
+
+    // daemon: one job per connection, each parsed on top of the options
+    // the daemon was started with
+    int fd_listen = noctar_daemon_listen(opts.listen_socket.c_str());
+    if (fd_listen < 0)
+        exit(1);
+    printf("daemon      :   listening on %s\n", opts.listen_socket.c_str());
+    while (true) {
+        int fd_job = accept(fd_listen, NULL, NULL);
+        if (fd_job < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            break;
+        }
+        uint64_t t0 = noctar_clock_ns();
+
+        std::vector<std::string> args;
+        packet_tx_options job = opts;
+        job.listen_socket.clear();
+        char reply[512];
+        if (!noctar_daemon_recv_job(fd_job, &args)) {
+            snprintf(reply, sizeof(reply), "error: bad job line\n");
+        } else {
+            std::vector<char *> job_argv = noctar_daemon_argv(argv[0], args);
+            if (!packet_tx_parse(&job, job_argv.size()-1, &job_argv[0]) ||
+                job.help || job.sweep || !job.listen_socket.empty())
+            {
+                snprintf(reply, sizeof(reply), "error: bad job options\n");
+            } else if (!packet_tx_configure(&session, &job)) {
+                snprintf(reply, sizeof(reply), "error: could not configure the usrp\n");
+            } else {
+                uint64_t t1 = noctar_clock_ns();
+                bool ok = packet_tx_trial(&session, &job);
+                snprintf(reply, sizeof(reply), "%s capture: %s configure ms: %.3f trial ms: %.3f\n",
+                         ok ? "ok" : "error", job.output.c_str(),
+                         (t1 - t0)*1e-6, (noctar_clock_ns() - t1)*1e-6);
+            }
+        }
+        printf("daemon      :   %s", reply);
+        noctar_daemon_send(fd_job, reply);
+        close(fd_job);
+    }
+    close(fd_listen);
+    unlink(opts.listen_socket.c_str());
+    close(session.fd_read);
+    return 1;
+}
 
-    // get actual tx rate
-    usrp_tx_rate = usrp->get_tx_rate();
+void packet_tx_options_init(packet_tx_options *_o)
+{
+    _o->verbose = true;
+    _o->frequency = 462.0e6;
+    _o->bandwidth = 250e3f;
+    _o->num_frames = 2000;
+    _o->txgain_dB = -12.0f;
+    _o->uhd_txgain = 40.0;
+    _o->num_distinct = 0;
+    _o->framegen_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    _o->cpu_format = "fc32";
+    _o->otw_format = "";
+    _o->packets_per_send = 1;
+    _o->tx_lead = 0.0;
+    _o->schedule_file = "";
+    _o->sweep_spec = "";
+    _o->retune_guard = 0.01;
+    _o->output = "./noctar_samples";
+    _o->listen_socket = "";
+    _o->submit_socket = "";
+    _o->sweep = false;
+    _o->help = false;
+
+    // capture settings (read size, chunk size, ring depth, alignment)
+    capture_config_init(&_o->capture_cfg, 100);
+}
 
-    //usrp_tx_rate = 262295.081967213;
-    // compute arbitrary resampling rate
-    double tx_resamp_rate = usrp_tx_rate / tx_rate;
+// parse _argv on top of whatever _o already holds (defaults, or the
+// daemon's own options for a job); returns false with a message if the
+// options are unusable
+bool packet_tx_parse(packet_tx_options *_o, int _argc, char **_argv)
+{
+    double min_bandwidth = 0.25*(DAC_RATE / 512.0);
+    double max_bandwidth = 0.25*(DAC_RATE /   4.0);
+    capture_config &capture_cfg = _o->capture_cfg;
+
+    // glibc: optind = 0 restarts the scan for every job
+    optind = 0;
+    int d;
+    while ((d = getopt(_argc,_argv,"uhqvf:b:g:G:N:L:j:F:O:S:T:B:X:R:o:s:J:c:K:r:C:n:A:D:d:t:P:w")) != EOF) {
+        switch (d) {
+        case 'u':
+        case 'h':   _o->help        = true;             break;
+        case 'q':   _o->verbose     = false;            break;
+        case 'v':   _o->verbose     = true;             break;
+        case 'f':   _o->frequency   = atof(optarg);     break;
+        case 'b':   _o->bandwidth   = atof(optarg);     break;
+        case 'g':   _o->txgain_dB   = atof(optarg);     break;
+        case 'G':   _o->uhd_txgain  = atof(optarg);     break;
+        case 'N':   _o->num_frames  = atoi(optarg);     break;
+        case 'L':   _o->num_distinct = atoi(optarg);    break;
+        case 'j':   _o->framegen_threads = atoi(optarg); break;
+        case 'F':   _o->cpu_format  = optarg;           break;
+        case 'O':   _o->otw_format  = optarg;           break;
+        case 'S':   _o->packets_per_send = atoi(optarg); break;
+        case 'T':   _o->tx_lead     = atof(optarg);     break;
+        case 'B':   _o->schedule_file = optarg;         break;
+        case 'X':   _o->sweep_spec  = optarg;           break;
+        case 'R':   _o->retune_guard = atof(optarg);    break;
+        case 'o':   _o->output      = optarg;           break;
+        case 's':   _o->listen_socket = optarg;         break;
+        case 'J':   _o->submit_socket = optarg;         break;
+        case 'c':
+            if (!capture_config_load(&capture_cfg, optarg))
+                return false;
+            break;
+        case 'K': {
+            // one config key on the command line, e.g. -K writer_cpu=3
+            std::string kv(optarg);
+            size_t eq = kv.find('=');
+            if (eq == std::string::npos || !capture_config_set(&capture_cfg, kv.substr(0, eq).c_str(), kv.c_str() + eq + 1)) {
+                fprintf(stderr,"error: %s, bad config setting '%s'\n", _argv[0], optarg);
+                return false;
+            }
+            break;
+        }
+        case 'r':   capture_cfg.read_samples = atoi(optarg);    break;
+        case 'C':   capture_cfg.chunk_kbytes = atoi(optarg);    break;
+        case 'n':   capture_cfg.ring_chunks  = atoi(optarg);    break;
+        case 'A':   capture_cfg.alignment    = atoi(optarg);    break;
+        case 'D':   capture_cfg.aio_depth    = atoi(optarg);    break;
+        case 'd':   capture_cfg.detect_window    = atoi(optarg);    break;
+        case 't':   capture_cfg.detect_threshold = atof(optarg);    break;
+        case 'P':   capture_cfg.tx_cpu           = atoi(optarg);    break;
+        case 'w':   _o->sweep = true;                           break;
+        default:
+            _o->help = true;
+            return true;
+        }
+    }
+    if (_o->help)
+        return true;
+
+    if (_o->bandwidth > max_bandwidth) {
+        fprintf(stderr,"error: %s, maximum bandwidth exceeded (%8.4f MHz)\n", _argv[0], max_bandwidth*1e-6);
+        return false;
+    } else if (_o->bandwidth < min_bandwidth) {
+        fprintf(stderr,"error: %s, minimum bandwidth exceeded (%8.4f kHz)\n", _argv[0], min_bandwidth*1e-3);
+        return false;
+    }
 
-    usrp->set_tx_freq(frequency);
-    usrp->set_tx_gain(uhd_txgain);
+    if (!capture_config_validate(&capture_cfg))
+        return false;
+    if (tx_format_sample_bytes(_o->cpu_format.c_str()) == 0) {
+        fprintf(stderr,"error: %s, unsupported cpu format '%s'\n", _argv[0], _o->cpu_format.c_str());
+        return false;
+    }
+    if (!_o->otw_format.empty() && _o->otw_format != "sc16" && _o->otw_format != "sc8") {
+        fprintf(stderr,"error: %s, unsupported otw format '%s'\n", _argv[0], _o->otw_format.c_str());
+        return false;
+    }
+    if (_o->tx_lead < 0.0) {
+        fprintf(stderr,"error: %s, burst lead time must not be negative\n", _argv[0]);
+        return false;
+    }
+    if (_o->num_distinct > TX_FRAMEGEN_MAX_DISTINCT) {
+        fprintf(stderr,"error: %s, at most %u distinct frames (16-bit frame id)\n", _argv[0], TX_FRAMEGEN_MAX_DISTINCT);
+        return false;
+    }
+    return true;
+}
 
-    printf("frequency   :   %12.8f [MHz]\n", frequency*1e-6f);
-    printf("bandwidth   :   %12.8f [kHz]\n", bandwidth*1e-3f);
-    printf("verbosity   :   %s\n", (verbose?"enabled":"disabled"));
+// bring the usrp to the rate, frequency, gain and stream formats of _o,
+// touching only what differs from the last trial of the session
+bool packet_tx_configure(packet_tx_session *_s, const packet_tx_options *_o)
+{
+    uhd::usrp::multi_usrp::sptr usrp = _s->usrp;
+
+    if (_o->bandwidth != _s->bandwidth) {
+        // set properties
+        double tx_rate = 4.0*_o->bandwidth;
+
+        // NOTE : the sample rate computation MUST be in double precision so
+        //        that the UHD can compute its interpolation rate properly
+        unsigned int interp_rate = (unsigned int)(DAC_RATE / tx_rate);
+        // ensure multiple of 4
+        interp_rate = (interp_rate >> 2) << 2;
+        // NOTE : there seems to be a bug where if the interp rate is equal to
+        //        240 or 244 we get some weird warning saying that
+        //        "The hardware does not support the requested TX sample rate"
+        while (interp_rate == 240 || interp_rate == 244)
+            interp_rate -= 4;
+        // compute usrp sampling rate
+        double usrp_tx_rate = DAC_RATE / (double)interp_rate;
+
+        // try to set tx rate
+        usrp->set_tx_rate(DAC_RATE / interp_rate);
+
+        // get actual tx rate
+        usrp_tx_rate = usrp->get_tx_rate();
+
+        //usrp_tx_rate = 262295.081967213;
+        // compute arbitrary resampling rate
+        double tx_resamp_rate = usrp_tx_rate / tx_rate;
+
+        printf("bandwidth   :   %12.8f [kHz]\n", _o->bandwidth*1e-3f);
+        printf("sample rate :   %12.8f kHz = %12.8f * %8.6f (interp %u)\n",
+                tx_rate * 1e-3f,
+                usrp_tx_rate * 1e-3f,
+                1.0 / tx_resamp_rate,
+                interp_rate);
+
+        _s->bandwidth    = _o->bandwidth;
+        _s->usrp_tx_rate = usrp_tx_rate;
+    }
 
-    printf("sample rate :   %12.8f kHz = %12.8f * %8.6f (interp %u)\n",
-            tx_rate * 1e-3f,
-            usrp_tx_rate * 1e-3f,
-            1.0 / tx_resamp_rate,
-            interp_rate);
+    if (_o->frequency != _s->frequency) {
+        usrp->set_tx_freq(_o->frequency);
+        printf("frequency   :   %12.8f [MHz]\n", _o->frequency*1e-6f);
+        _s->frequency = _o->frequency;
+    }
+    if (_o->uhd_txgain != _s->uhd_txgain) {
+        usrp->set_tx_gain(_o->uhd_txgain);
+        _s->uhd_txgain = _o->uhd_txgain;
+    }
+    printf("verbosity   :   %s\n", (_o->verbose?"enabled":"disabled"));
 
     // set the IF filter bandwidth
     //usrp->set_tx_bandwidth(2.0f*tx_rate);
 
-    // transmitter gain (linear)
-    float g = powf(10.0f, txgain_dB/20.0f);
+    // Streamer API test
+    // the waveform is quantized to cpu_format up front, so the streamer
+    // only has to copy (sc16 -> sc16) or narrow to the otw format
+    if (!_s->tx_stream || _o->cpu_format != _s->cpu_format || _o->otw_format != _s->otw_format) {
+        _s->tx_stream.reset();
+        uhd::stream_args_t stream_args(_o->cpu_format, _o->otw_format);
+        _s->tx_stream  = usrp->get_tx_stream(stream_args);
+        _s->cpu_format = _o->cpu_format;
+        _s->otw_format = _o->otw_format;
+    }
+    return true;
+}
 
-    // data arrays
-        unsigned char header[8];
-        unsigned char payload[64];
-    
-    // create frame generator
-    framegen64 fg = framegen64_create();
-    framegen64_print(fg);
+// run one trial on an open session: build the schedule and its
+// waveforms, capture to _o->output while the bursts go out, and write
+// <output>.log; returns false if the trial could not be set up
+bool packet_tx_trial(packet_tx_session *_s, const packet_tx_options *_o)
+{
+    bool verbose = _o->verbose;
+    unsigned int num_frames = _o->num_frames;
+    double txgain_dB = _o->txgain_dB;
+    unsigned int num_distinct = _o->num_distinct;
+    unsigned int framegen_threads = _o->framegen_threads;
+    const std::string &cpu_format = _o->cpu_format;
+    const std::string &otw_format = _o->otw_format;
+    unsigned int packets_per_send = _o->packets_per_send;
+    double tx_lead = _o->tx_lead;
+    double retune_guard = _o->retune_guard;
+    const capture_config &capture_cfg = _o->capture_cfg;
+
+    uhd::usrp::multi_usrp::sptr usrp = _s->usrp;
+    uhd::tx_streamer::sptr tx_stream = _s->tx_stream;
+    double usrp_tx_rate = _s->usrp_tx_rate;
+    int fd_read = _s->fd_read;
+
+    // the stored channel must hold the whole burst: its pass band (0.4
+    // of the channel rate either side) only covers the tx signal when
+    // the channel rate is at least the tx rate
+    if (capture_cfg.channel_decim > 0 && capture_cfg.noctar_rate / capture_cfg.channel_decim < usrp_tx_rate) {
+        fprintf(stderr,"error: channel rate %.0f (noctar_rate/channel_decim) is below the tx rate %.0f, lower channel_decim\n",
+                capture_cfg.noctar_rate / capture_cfg.channel_decim, usrp_tx_rate);
+        return false;
+    }
 
-    // allocate array to hold frame generator samples
     unsigned int frame_len = FRAME64_LEN;   // length of frame64 (defined in liquid.h)
-    std::complex<float> frame_samples[frame_len];
     //std::cout << frame_len << std::endl;
     /* alho:
        as of may 7 2013, on belinkov-precision-t5600
@@ -185,185 +546,653 @@ int main (int argc, char **argv)
     md.end_of_burst   = false;  // 
     md.has_time_spec  = false;  // set to false to send immediately
 
-    // Streamer API test
-    uhd::stream_args_t stream_args("fc32"); //complex floats
-    uhd::tx_streamer::sptr tx_stream = usrp->get_tx_stream(stream_args);
-
-    /**/    unsigned int j;
-
-
-    // create one frame for the entire transmission
-    // write header (first two bytes packet ID, remaining are random)
-     unsigned int fixed_pid = 0; // try framing a fixed packet
-                header[0] = (fixed_pid >> 8) & 0xff;
-	        header[1] = (fixed_pid     ) & 0xff;
-	        for (j=2; j<8; j++)
-	          header[j] = rand() & 0xff;
-
-    /// initialize payload
-    for (j=0; j<64; j++)
-        payload[j] = rand() & 0xff;
-
-    // generate the entire frame
-    framegen64_execute(fg, header, payload, frame_samples);
-
-    // prepare buffs
-    //unsigned int num_buffers = frame_len / 256;
-    std::vector<std::vector<std::complex<float> *> > buffs_vec;
-    unsigned int usrp_sample_counter = 0;
-    std::vector<std::complex<float> > cur_usrp_buffer(256);
-    for (j=0; j<frame_len; j++) {
-        cur_usrp_buffer[usrp_sample_counter++] = g*frame_samples[j];
-        if (usrp_sample_counter == 256) {
-            usrp_sample_counter = 0;
-            std::vector<std::complex<float> > usrp_buffer(cur_usrp_buffer);
-            std::vector<std::complex<float> *> buffs(usrp->get_tx_num_channels(), &usrp_buffer.front());    
-            buffs_vec.push_back(buffs);
+    // burst schedule: from -B, or the one burst given on the command
+    // line, delta samples into the capture
+    int64_t delta = 1 * (2.4e9)/32/10;// sample rate of noctar (2.4e9)/16
+    std::vector<tx_burst_entry> schedule;
+    if (!_o->schedule_file.empty()) {
+        if (!tx_schedule_load(&schedule, _o->schedule_file.c_str(), num_frames, txgain_dB))
+            return false;
+    } else {
+        tx_burst_entry e;
+        e.type       = TX_BURST_AFTER_GAP;
+        e.start      = delta;
+        e.num_frames = num_frames;
+        e.gain_dB    = txgain_dB;
+        e.frequency  = 0.0;
+        e.uhd_gain   = NAN;
+        e.waveform   = 0;
+        schedule.push_back(e);
+    }
+    if (!_o->sweep_spec.empty()) {
+        double f0, f1, step;
+        if (sscanf(_o->sweep_spec.c_str(), "%lf:%lf:%lf", &f0, &f1, &step) != 3 ||
+            !tx_schedule_sweep(&schedule, f0, f1, step))
+        {
+            fprintf(stderr,"error: bad frequency sweep '%s', expected f0:f1:step\n", _o->sweep_spec.c_str());
+            return false;
         }
     }
-
-
-    // open noctar device
-    int fd_read = open("/dev/langford", O_RDONLY);
-    // open file to write
-    int fd_write = open("./noctar_samples", O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR
-                                          | S_IWUSR | S_IROTH | S_IWOTH);
+    // '@' times and timed commands are relative to startup
+    if (tx_schedule_timed(schedule) || tx_schedule_retunes(schedule))
+        usrp->set_time_now(uhd::time_spec_t(0.0));
+
+    // prepare one waveform per distinct (frames, gain) pair in the
+    // schedule: the whole scaled burst in one aligned buffer, cut into
+    // sends of packets_per_send full usrp packets (the streamer fragments
+    // each send into packets itself), generated in parallel and
+    // pre-quantized once, so nothing is generated or converted after the
+    // trigger
+    size_t max_send = (size_t)packets_per_send*tx_stream->get_max_num_samps();
+    std::vector<tx_waveform> waveforms;
+    size_t num_tx_events = 0;
+    bool ok = true;
+    for (unsigned int b=0; b<schedule.size() && ok; b++) {
+        tx_burst_entry &e = schedule[b];
+        unsigned int i;
+        for (i=0; i<b; i++) {
+            if (schedule[i].num_frames == e.num_frames && schedule[i].gain_dB == e.gain_dB)
+                break;
+        }
+        if (i < b) {
+            e.waveform = schedule[i].waveform;
+        } else {
+            e.waveform = waveforms.size();
+            waveforms.push_back(tx_waveform());
+            tx_waveform &w = waveforms.back();
+            size_t burst_samples = (size_t)e.num_frames*frame_len;
+            if (!tx_waveform_create(&w, burst_samples, usrp->get_tx_num_channels(),
+                                    max_send > 0 ? max_send : burst_samples))
+            {
+                ok = false;
+                break;
+            }
+            tx_framegen_burst(&w, e.num_frames, num_distinct, powf(10.0f, e.gain_dB/20.0f), 1, framegen_threads);
+            if (!tx_waveform_quantize(&w, cpu_format.c_str(), framegen_threads)) {
+                ok = false;
+                break;
+            }
+            printf("tx burst    :   %zu samples in %zu send() calls, gain %.1f dB\n",
+                    burst_samples, w.chunks.size(), e.gain_dB);
+        }
+        num_tx_events += waveforms[e.waveform].chunks.size() + 2;
+    }
+    if (!ok) {
+        for (unsigned int w=0; w<waveforms.size(); w++)
+            tx_waveform_destroy(&waveforms[w]);
+        return false;
+    }
+    // the worker streams the waveforms out, so they live on its node
+    int tx_node = placement_cpu_node(capture_cfg.tx_cpu);
+    for (unsigned int w=0; w<waveforms.size(); w++)
+        placement_bind(waveforms[w].data, waveforms[w].num_samples*waveforms[w].sample_bytes, tx_node);
+    printf("tx schedule :   %zu bursts, %zu waveforms\n", schedule.size(), waveforms.size());
+    printf("tx format   :   cpu %s, otw %s\n", cpu_format.c_str(),
+            otw_format.empty() ? "default" : otw_format.c_str());
+
+
+    // open file to write (noctar itself is held open by the session);
+    // channelized and compressed output have no fixed size, so they are
+    // always written through the page cache
+    bool direct_io = capture_cfg.aio_depth > 0 && capture_cfg.channel_decim == 0 &&
+                     capture_cfg.compress_threads == 0;
+    int fd_write = capture_open(_o->output.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                                S_IRUSR | S_IWUSR | S_IROTH | S_IWOTH, &direct_io);
+    if (fd_write < 0) {
+        fprintf(stderr,"error: could not open capture file '%s'\n", _o->output.c_str());
+        for (unsigned int w=0; w<waveforms.size(); w++)
+            tx_waveform_destroy(&waveforms[w]);
+        return false;
+    }
 
     // parameters for receive loop
-    unsigned int num_samples_to_read = 100;
+    unsigned int num_samples_to_read = capture_cfg.read_samples;
     unsigned int num_bytes_to_read = 4*num_samples_to_read;
-    char buff[num_bytes_to_read];
     //ssize_t num_read_samples = read(fd_read, buff, num_bytes_to_read);
     ssize_t num_read_bytes = 0;
     ssize_t num_read_samples = 0;
-    int64_t start_transmit = 0;
-    int64_t end_transmit = 0; 
     int64_t end_program = 0; 
     int64_t receive_sample_counter = 0;
-    int64_t delta = 1 * (2.4e9)/32/10;// sample rate of noctar (2.4e9)/16
-    
-    // thread
-    pthread_t transmit_thread;
-    int iret; // return value of create thread
+    int read_error = 0;                 // errno of a failed read, ending the capture early
 
+    // schedule progress
+    std::vector<tx_burst_result> results(schedule.size(), tx_burst_result());
+    unsigned int next_burst = 0;        // schedule entry in flight or next
+    int64_t next_start = schedule[0].type == TX_BURST_AFTER_GAP ? (int64_t)schedule[0].start : 0;
+    unsigned int ack_base = 0;          // burst ACKs before the current burst
+    
     // status flags
-    bool transmitted = false;
-    bool finished_transmitting = false;
-    bool end_transmit_flag = false;
+    bool in_burst = false;
+    bool send_done_flag = false;
     
     
     // construct arguments for transmit function
     struct transmit_arg_struct transmit_args;
-    transmit_args.num_frames = num_frames;
     transmit_args.tx_stream = tx_stream;
-    transmit_args.buffs_vec = buffs_vec;
+    transmit_args.waveform = &waveforms[schedule[0].waveform];
+    transmit_args.tx_rate = usrp_tx_rate;
+    transmit_args.send_ns = 0;
     transmit_args.md = md;
-    transmit_args.finished_transmitting = &finished_transmitting;
     transmit_args.verbose = verbose;
     transmit_args.usrp = usrp;
+    transmit_args.at_time = -1.0;
+    transmit_args.lead = tx_lead;
+    transmit_args.armed_time = 0.0;
+    transmit_args.scheduled_time = 0.0;
+    transmit_args.armed_ns = 0;
+    transmit_args.frequency = 0.0;
+    transmit_args.uhd_gain = NAN;
+    transmit_args.retune_guard = retune_guard;
+    transmit_args.command_time = 0.0;
+    transmit_args.lock_time = 0.0;
+    transmit_args.retune_ns = 0;
+
+    // timestamps of every send() and the EOB, mapped to sample indices
+    // by the receive loop
+    tx_event_log tx_events;
+    tx_event_log_init(&tx_events, num_tx_events);
+    transmit_args.events = &tx_events;
+
+    // transmit worker: created now and parked until each trigger, so no
+    // thread creation sits on the measured path
+    tx_worker worker;
+    bool worker_ok = tx_worker_start(&worker, transmit, (void *)&transmit_args, capture_cfg.tx_cpu);
+
+    // async monitor: drains burst ACKs, underflows and sequence errors
+    tx_async_monitor async_monitor;
+    bool async_ok = worker_ok && tx_async_monitor_start(&async_monitor, usrp->get_device(), 1024);
+
+    // capture ring: reads land back-to-back in large page-aligned chunks
+    // which a separate writer thread drains to disk; started before the
+    // priority change so the writer does not inherit SCHED_FIFO
+    capture_writer writer;
+    size_t chunk_bytes = (size_t)capture_cfg.chunk_kbytes*1024;
+    if (chunk_bytes < num_bytes_to_read)
+        chunk_bytes = num_bytes_to_read;
+    if (!async_ok || !capture_writer_start(&writer, fd_write, chunk_bytes, capture_cfg.ring_chunks,
+                                           direct_io, capture_cfg.aio_depth, capture_cfg.alignment))
+    {
+        if (async_ok)  tx_async_monitor_stop(&async_monitor);
+        if (worker_ok) tx_worker_stop(&worker);
+        for (unsigned int w=0; w<waveforms.size(); w++)
+            tx_waveform_destroy(&waveforms[w]);
+        close(fd_write);
+        return false;
+    }
+
+    // pin the writer and async monitor (the worker pins itself, the
+    // reader is pinned once every helper thread exists); the capture ring
+    // is filled by the reader's read() calls, so it follows the reader's
+    // node
+    placement_pin(writer.thread, capture_cfg.writer_cpu, "capture writer");
+    placement_pin(async_monitor.thread, capture_cfg.async_cpu, "tx async monitor");
+    placement_bind(writer.pool.base, writer.pool.map_bytes, placement_cpu_node(capture_cfg.reader_cpu));
+
+    // log file is opened up front so the burst detector can report live
+    std::ofstream log_file;
+    log_file.open((_o->output + ".log").c_str());
+
+    // burst detection runs on the writer thread, ahead of the disk
+    burst_detector detector;
+    if (capture_cfg.detect_window > 0) {
+        burst_detector_init(&detector, capture_cfg.detect_window, capture_cfg.detect_threshold, &log_file);
+        capture_writer_set_process(&writer, burst_detector_process, &detector);
+    }
+
+    // channelizer: also on the writer thread, after the detector (which
+    // keeps working on raw samples), so only the tx channel is written
+    channelizer chan;
+    frame_decoder decoder;
+    channel_decode_arg_struct chan_decode;
+    chan_decode.chan    = &chan;
+    chan_decode.decoder = NULL;
+    if (capture_cfg.channel_decim > 0) {
+        double offset = capture_cfg.noctar_center > 0.0 ?
+                        _o->frequency - capture_cfg.noctar_center : capture_cfg.channel_offset;
+        if (channelizer_init(&chan, capture_cfg.noctar_rate, offset, capture_cfg.channel_decim, capture_cfg.channel_taps) &&
+            capture_writer_set_transform(&writer, channel_decode_process, &chan_decode))
+        {
+            log_file << "channelizer: decimation: " << chan.decim << " taps: " << chan.num_taps << " offset: " << offset << " output rate: " << capture_cfg.noctar_rate / chan.decim << " delay: " << 0.5*(chan.num_taps - 1) << " raw samples (output sample k is raw sample k*" << chan.decim << ")" << std::endl;
+
+            // frames are decoded from the channel on their own threads,
+            // resampled to the rate they were sent at
+            if (capture_cfg.decode_threads > 0 &&
+                frame_decoder_start(&decoder, capture_cfg.noctar_rate / chan.decim, usrp_tx_rate,
+                                    chan.decim, 0.5*(chan.num_taps - 1), capture_cfg.decode_threads))
+                chan_decode.decoder = &decoder;
+        } else {
+            fprintf(stderr,"warning: channelizer disabled, storing raw samples\n");
+        }
+    }
+
+    // lossless compression of the raw samples, on the writer thread and
+    // compress_threads-1 helpers; the helpers are kept off the reader's
+    // cpu, where the SCHED_FIFO reader would starve them
+    noctar_compressor compressor;
+    bool compressing = false;
+    if (capture_cfg.compress_threads > 0 && writer.transform == NULL &&
+        noctar_compressor_start(&compressor, capture_cfg.compress_threads, writer.pool.chunk_bytes))
+    {
+        for (unsigned int k=0; k<compressor.workers.size(); k++)
+            placement_avoid(compressor.workers[k].thread, capture_cfg.reader_cpu, "compression worker");
+        compressing = capture_writer_set_transform(&writer, noctar_compressor_process, &compressor);
+        if (!compressing)
+            noctar_compressor_stop(&compressor);
+    }
+    if (capture_cfg.compress_threads > 0 && !compressing)
+        fprintf(stderr,"warning: compression disabled, storing raw samples\n");
+
+    // container: the header goes in front now, the body follows it and
+    // the index is appended once the trial is over
+    noctar_container_header container;
+    bool use_container = capture_cfg.container;
+    if (use_container) {
+        noctar_container_header_init(&container);
+        bool channelized = writer.transform != NULL && !compressing;
+        container.sample_format  = compressing ? NOCTAR_FORMAT_SC16_PACKED : NOCTAR_FORMAT_SC16;
+        container.decimation     = channelized ? chan.decim : 1;
+        container.sample_rate    = capture_cfg.noctar_rate / container.decimation;
+        container.noctar_rate    = capture_cfg.noctar_rate;
+        container.noctar_center  = capture_cfg.noctar_center;
+        container.channel_offset = channelized ? chan.offset * capture_cfg.noctar_rate : 0.0;
+        container.channel_delay  = channelized ? 0.5*(chan.num_taps - 1) : 0.0;
+        container.tx_frequency   = _o->frequency;
+        container.tx_rate        = usrp_tx_rate;
+        container.tx_gain_dB     = txgain_dB;
+        container.uhd_gain       = _o->uhd_txgain;
+        container.chunk_bytes    = writer.pool.chunk_bytes;
+        container.created        = time(NULL);
+        if (!noctar_container_write_header(_o->output.c_str(), &container) ||
+            !capture_writer_set_file_offset(&writer, container.header_bytes))
+        {
+            fprintf(stderr,"warning: writing a raw capture instead of a container\n");
+            use_container = false;
+            capture_writer_set_file_offset(&writer, 0);
+        }
+    }
+
+    // the daemon runs every trial on its main thread, so the pin and
+    // the priority change are undone once the receive loop is over;
+    // otherwise the next trial's helper threads would inherit both
+    placement_saved reader_saved;
+    placement_save(pthread_self(), &reader_saved);
+
+    // pin the reader (this thread) only now: threads created after the
+    // pin (frame decoders, compression workers) would inherit its single
+    // cpu and be starved there once it runs at SCHED_FIFO
+    placement_pin(pthread_self(), capture_cfg.reader_cpu, "noctar reader");
+
+    // resulting placement, as the kernel reports it
+    std::ostringstream placement;
+    placement << "placement: reader cpus: " << placement_thread_cpus(pthread_self())
+              << " node: " << placement_cpu_node(capture_cfg.reader_cpu)
+              << " writer cpus: " << placement_thread_cpus(writer.thread)
+              << " node: " << placement_cpu_node(capture_cfg.writer_cpu)
+              << " tx worker cpus: " << placement_thread_cpus(worker.thread)
+              << " node: " << tx_node
+              << " async cpus: " << placement_thread_cpus(async_monitor.thread)
+              << " node: " << placement_cpu_node(capture_cfg.async_cpu)
+              << " capture ring node: " << placement_memory_node(writer.pool.base)
+              << " tx waveform node: " << placement_memory_node(waveforms[0].data)
+              << " compression worker cpus: " << (compressing && !compressor.workers.empty() ?
+                                                  placement_thread_cpus(compressor.workers[0].thread) : std::string("none"))
+              << " mlockall: " << (!capture_cfg.mlock ? "off" : _s->mlocked ? "ok" : strerror(_s->mlock_error));
+    printf("%s\n", placement.str().c_str());
+    log_file << placement.str() << std::endl;
 
     // set realtime priority
     set_realtime_priority();
+
+    // page faults are counted over the receive loop only
+    noctar_faults faults_start        = noctar_faults_now(false);
+    noctar_faults reader_faults_start = noctar_faults_now(true);
      
     ///////////// START COUNTER ////////////
     while(true) {
        
-        num_read_bytes = read(fd_read, buff, num_bytes_to_read);
+        num_read_bytes = capture_writer_read(&writer, fd_read, num_bytes_to_read);
+        if (num_read_bytes < 0 && errno == EINTR)
+            continue;
+        if (num_read_bytes < 0) {
+            read_error = errno;
+            perror("read /dev/langford");
+            end_program = receive_sample_counter;
+            break;
+        }
 	num_read_samples = num_read_bytes / 4;
         receive_sample_counter += num_read_samples;
+        tx_event_log_read_done(&tx_events, noctar_clock_ns(), receive_sample_counter);
         
-        // transmit
-        if (!transmitted && receive_sample_counter >= delta) {
-           transmitted = true;
-           start_transmit = receive_sample_counter;
-	   //std::cout << "start transmission: " << start_transmit << std::endl;
+        // transmit the next scheduled burst
+        if (!in_burst && next_burst < schedule.size() && receive_sample_counter >= next_start) {
+           const tx_burst_entry &e = schedule[next_burst];
+           results[next_burst].start      = receive_sample_counter;
+           results[next_burst].trigger_ns = noctar_clock_ns();
+	   //std::cout << "start transmission: " << receive_sample_counter << std::endl;
+
+           // the worker is idle between bursts, so its arguments can change
+           transmit_args.waveform = &waveforms[e.waveform];
+           transmit_args.at_time  = e.type == TX_BURST_AT_TIME ? e.start : -1.0;
+           transmit_args.frequency = e.frequency;
+           transmit_args.uhd_gain  = e.uhd_gain;
+           ack_base = tx_async_monitor_acks(&async_monitor);
+           in_burst = true;
               
-           // transmit with thread
-	   iret = pthread_create( &transmit_thread, NULL, transmit, (void *)&transmit_args);
-	   //transmit(num_frames, tx_stream, buffs_vec, md, &finished_transmitting, verbose);
+           // wake the transmit worker
+	   tx_worker_trigger(&worker);
         }
         
-        // done transmitting? 
-        if (!end_transmit_flag && finished_transmitting) {
-            end_transmit_flag = true;
-	    end_transmit = receive_sample_counter;
-	    //std::cout << "finished transmitting: " << end_transmit << std::endl;
-	    
+        // send() of the EOB returned
+        if (in_burst && !send_done_flag && tx_worker_done(&worker) > next_burst) {
+            send_done_flag = true;
+            results[next_burst].send_done = receive_sample_counter;
         }
 
-	if (end_transmit_flag) {
-            // wait for delta before ending
-	    if (receive_sample_counter > end_transmit+delta) {
-	    	//std::cout << "end program: " << receive_sample_counter << std::endl;
-                end_program = receive_sample_counter;
-	    	break;
-	    }
+        // done transmitting?  the device acknowledged the burst, or it
+        // did not within delta samples of send() returning
+        if (send_done_flag) {
+            tx_burst_result &r = results[next_burst];
+            unsigned int acks = tx_async_monitor_acks(&async_monitor);
+            if (acks > ack_base || receive_sample_counter > r.send_done + delta) {
+	        r.end   = receive_sample_counter;
+                r.acked = acks > ack_base;
+                r.armed_time     = transmit_args.armed_time;
+                r.scheduled_time = transmit_args.scheduled_time;
+                r.send_ns        = transmit_args.send_ns;
+                r.command_time   = transmit_args.command_time;
+                r.lock_time      = transmit_args.lock_time;
+                r.retune_ns      = transmit_args.retune_ns;
+	        //std::cout << "finished transmitting: " << receive_sample_counter << std::endl;
+
+                in_burst = false;
+                send_done_flag = false;
+                next_burst++;
+                if (next_burst < schedule.size()) {
+                    const tx_burst_entry &e = schedule[next_burst];
+                    next_start = receive_sample_counter;
+                    if (e.type == TX_BURST_AFTER_GAP)
+                        next_start += (int64_t)e.start;
+                }
+            }
+        }
+
+        // wait for delta after the last burst before ending
+	if (next_burst == schedule.size() && receive_sample_counter > results.back().end + delta) {
+	    //std::cout << "end program: " << receive_sample_counter << std::endl;
+            end_program = receive_sample_counter;
+	    break;
 	}
+    }
 
-	write(fd_write, buff, num_read_bytes);
+    noctar_faults faults        = noctar_faults_since(faults_start, noctar_faults_now(false));
+    noctar_faults reader_faults = noctar_faults_since(reader_faults_start, noctar_faults_now(true));
 
-        
+    placement_restore(pthread_self(), &reader_saved, "noctar reader");
+
+    tx_worker_stop(&worker);
+    tx_async_monitor_stop(&async_monitor);
+
+    // flush the partially filled chunk and wait for the writer
+    capture_writer_stop(&writer);
+
+    if (compressing)
+        noctar_compressor_stop(&compressor);
+
+    // the writer fed the decoder its last samples; let it finish
+    std::vector<frame_decode_result> rx_frames;
+    if (chan_decode.decoder != NULL)
+        frame_decoder_stop(&decoder, &rx_frames);
+
+    // how the arenas came out, before the waveforms go
+    size_t waveform_bytes = 0;
+    unsigned int waveforms_huge = 0, waveforms_locked = 0;
+    for (unsigned int w=0; w<waveforms.size(); w++) {
+        const noctar_arena &a = waveforms[w].samples != NULL ? waveforms[w].samples_arena : waveforms[w].data_arena;
+        waveform_bytes   += a.bytes;
+        waveforms_huge   += a.huge;
+        waveforms_locked += a.locked;
     }
+    for (unsigned int w=0; w<waveforms.size(); w++)
+        tx_waveform_destroy(&waveforms[w]);
 
-    // close noctar
-    close(fd_read);
     close(fd_write);
+
+    // container index: where the body is contiguous, then what happened
+    // when, all on the raw Noctar sample grid
+    if (use_container) {
+        std::vector<noctar_index_entry> index;
+        for (unsigned int i=0; i<writer.runs.size(); i++)
+            index.push_back(noctar_index_make(NOCTAR_INDEX_RUN, i, writer.runs[i].stream_offset / 4,
+                                              writer.runs[i].file_offset / 4));
+        if (compressing) {
+            for (unsigned int i=0; i<compressor.blocks.size(); i++) {
+                const noctar_compress_block_info &b = compressor.blocks[i];
+                index.push_back(noctar_index_make(NOCTAR_INDEX_BLOCK, i, b.stream_offset / 4,
+                                                  b.packed_offset, b.samples));
+            }
+        }
+        for (unsigned int b=0; b<schedule.size(); b++) {
+            const tx_burst_result &r = results[b];
+            double f = schedule[b].frequency > 0.0 ? schedule[b].frequency : _o->frequency;
+            index.push_back(noctar_index_make(NOCTAR_INDEX_TX_BURST, b, r.start, r.end, f, r.acked ? 1 : 0));
+            index.push_back(noctar_index_make(NOCTAR_INDEX_TX_SEND_DONE, b, r.send_done));
+        }
+        for (unsigned int i=0; i<tx_events.count; i++) {
+            const tx_event &e = tx_events.events[i];
+            if (e.mapped)
+                index.push_back(noctar_index_make(NOCTAR_INDEX_TX_EVENT, e.type, (uint64_t)llround(e.sample),
+                                                  0, e.sample));
+        }
+        if (capture_cfg.detect_window > 0) {
+            for (unsigned int i=0; i<detector.tracker.bursts.size(); i++) {
+                const burst_record &d = detector.tracker.bursts[i];
+                index.push_back(noctar_index_make(NOCTAR_INDEX_DETECTION, i, d.start, d.end, d.peak_power));
+            }
+        }
+        for (unsigned int i=0; i<rx_frames.size(); i++) {
+            const frame_decode_result &f = rx_frames[i];
+            index.push_back(noctar_index_make(NOCTAR_INDEX_RX_FRAME, f.pid, (uint64_t)llround(f.raw_index),
+                                              0, f.evm, (f.header_valid ? 1 : 0) | (f.payload_valid ? 2 : 0)));
+        }
+        index.push_back(noctar_index_make(NOCTAR_INDEX_END, 0, end_program));
+
+        container.raw_samples     = writer.read_bytes / 4;
+        container.dropped_samples = writer.dropped_bytes / 4;
+        if (noctar_container_finish(_o->output.c_str(), &container, writer.bytes_written, index))
+            log_file << "container: body offset: " << container.header_bytes << " body samples: " << writer.bytes_written / 4 << " decimation: " << container.decimation << " index offset: " << container.index_offset << " index entries: " << container.index_count << " runs: " << writer.runs.size() << std::endl;
+    }
+
+    // retunes left the usrp wherever the last one went
+    if (tx_schedule_retunes(schedule)) {
+        _s->frequency  = NAN;
+        _s->uhd_txgain = NAN;
+    }
+
     // write log
-    std::ofstream log_file;
-    log_file.open("./noctar_samples.log");
-    log_file << "start transmission: " << start_transmit << " finished transmitting: " << end_transmit << " end program: " << end_program << std::endl;
+    log_file << "start transmission: " << results[0].start << " finished transmitting: " << results[0].end << " end program: " << end_program << std::endl;
+    if (read_error != 0)
+        log_file << "read error: " << strerror(read_error) << " capture truncated at sample: " << receive_sample_counter << " bursts finished: " << next_burst << "/" << schedule.size() << std::endl;
+    if (capture_cfg.channel_decim > 0 && writer.transform != NULL)
+        log_file << "channelizer outputs: " << chan.outputs << " gap samples: " << chan.gap_samples << std::endl;
+    if (chan_decode.decoder != NULL)
+        frame_decoder_write(log_file, &decoder, rx_frames);
+    if (compressing)
+        log_file << "compression: threads: " << compressor.num_threads << " blocks: " << compressor.blocks.size() << " raw bytes: " << compressor.raw_bytes << " packed bytes: " << compressor.packed_bytes << " ratio: " << (compressor.packed_bytes > 0 ? (double)compressor.raw_bytes / compressor.packed_bytes : 0.0) << " coding seconds: " << compressor.busy_ns * 1e-9 << " max chunk ms: " << compressor.max_chunk_ns * 1e-6 << " uncoded bytes: " << compressor.odd_bytes << std::endl;
+    log_file << "capture chunks written: " << writer.chunks_written << " bytes written: " << writer.bytes_written << " overflows: " << writer.overflows << " dropped bytes: " << writer.dropped_bytes << " max ring depth: " << writer.max_depth << " write errors: " << writer.write_errors << " direct i/o: " << (writer.direct ? "on" : "off") << " max writes in flight: " << writer.max_in_flight << std::endl;
+    log_file << "memory: capture ring bytes: " << writer.pool.arena.bytes << " huge pages: " << (writer.pool.arena.huge ? "yes" : "no") << " locked: " << (writer.pool.arena.locked ? "yes" : "no") << " tx waveform bytes: " << waveform_bytes << " huge pages: " << waveforms_huge << "/" << waveforms.size() << " locked: " << waveforms_locked << "/" << waveforms.size() << std::endl;
+    log_file << "page faults: minor: " << faults.minor << " major: " << faults.major << " reader minor: " << reader_faults.minor << " reader major: " << reader_faults.major << std::endl;
+    tx_async_monitor_write(log_file, &async_monitor);
+    log_file << "trigger ns: " << results[0].trigger_ns << " sample: " << results[0].start << std::endl;
+    tx_event_log_write(log_file, &tx_events);
+    log_file << "tx cpu format: " << cpu_format << " otw format: " << (otw_format.empty() ? "default" : otw_format) << std::endl;
+    log_file << "tx bursts: " << schedule.size() << " waveforms: " << waveforms.size() << " frame length: " << frame_len << " distinct frames (0: all): " << num_distinct << std::endl;
+    double total_samples = 0.0, total_seconds = 0.0;
+    for (unsigned int b=0; b<schedule.size(); b++) {
+        const tx_burst_entry &e = schedule[b];
+        const tx_burst_result &r = results[b];
+        size_t samples = (size_t)e.num_frames*frame_len;
+        // a timed burst waits for its time inside the first send()
+        double seconds = r.send_ns * 1e-9;
+        if (r.scheduled_time > 0.0)
+            seconds -= r.scheduled_time - r.armed_time;
+        total_samples += samples;
+        total_seconds += seconds;
+        log_file << "tx burst: " << b << " start: " << r.start << " send returned: " << r.send_done << " finished: " << r.end << " ack: " << (r.acked ? "yes" : "no") << " frames: " << e.num_frames << " gain: " << e.gain_dB << " trigger ns: " << r.trigger_ns << std::fixed << " armed usrp time: " << r.armed_time << " scheduled usrp time: " << r.scheduled_time << std::defaultfloat << " frequency: " << e.frequency << " uhd gain: " << e.uhd_gain << std::fixed << " command usrp time: " << r.command_time << " lock usrp time: " << r.lock_time << std::defaultfloat << " retune ns: " << r.retune_ns << " lock latency: " << (r.lock_time > 0.0 ? r.lock_time - r.command_time : 0.0) << " samples: " << samples << " seconds: " << seconds << " achieved rate: " << (seconds > 0 ? samples / seconds : 0.0) << std::endl;
+    }
+    printf("tx rate     :   %12.3f samples/s achieved, %12.3f configured\n",
+            total_seconds > 0 ? total_samples / total_seconds : 0.0, usrp_tx_rate);
+    if (capture_cfg.detect_window > 0) {
+        log_file << "burst detector window: " << detector.window << " threshold: " << detector.threshold << std::endl;
+        burst_write_table(log_file, detector.tracker.bursts);
+    }
     log_file.close();
 
-    return 0;
+    // what was captured is written and logged, but it is not the trial
+    // that was asked for
+    return read_error == 0;
 }
 
 
+
+
 //void *transmit(unsigned int num_frames, uhd::tx_streamer::sptr tx_stream, std::vector<std::vector<std::complex<float> *> > buffs_vec, uhd::tx_metadata_t md, bool &finished_transmitting, bool verbose) {
 
 void *transmit( void *args ) {
     transmit_arg_struct *transmit_args = (transmit_arg_struct*)args;
     uhd::tx_metadata_t md = transmit_args->md;
 
-    unsigned int pid;
-    for (pid=0; pid<transmit_args->num_frames; pid++) {
-        if (transmit_args->verbose)
-            printf("tx packet id: %6u\n", pid);
-        
-	    // STREAMER API'S SEND METHOD
-            for (unsigned int k=0; k<transmit_args->buffs_vec.size(); k++) {
-              transmit_args->tx_stream->send(transmit_args->buffs_vec[k], 256, md, 0.1);
-            }
+    // timed burst: the device holds the first packet until its time_spec,
+    // so host scheduling no longer moves the on-air start
+    double timeout = 0.1;
+    transmit_args->armed_ns       = 0;
+    transmit_args->armed_time     = 0.0;
+    transmit_args->scheduled_time = 0.0;
+    bool retuned = retune(transmit_args);
+    if (transmit_args->at_time >= 0.0 || transmit_args->lead > 0.0 || retuned) {
+        uhd::time_spec_t now = transmit_args->usrp->get_time_now();
+        uhd::time_spec_t when = transmit_args->at_time >= 0.0 ?
+                                uhd::time_spec_t(transmit_args->at_time) :
+                                now + uhd::time_spec_t(transmit_args->lead);
+        // a retuned burst never starts before the new settings are in
+        uhd::time_spec_t settled(transmit_args->command_time + transmit_args->retune_guard);
+        if (retuned && when < settled)
+            when = settled;
+        transmit_args->armed_ns       = noctar_clock_ns();
+        transmit_args->armed_time     = now.get_real_secs();
+        transmit_args->scheduled_time = when.get_real_secs();
+
+        md.start_of_burst = true;
+        md.has_time_spec  = true;
+        md.time_spec      = when;
+        if (when > now)
+            timeout += (when - now).get_real_secs();
+    }
 
-    } // packet loop
+    uint64_t t0 = noctar_clock_ns();
+    const tx_waveform *waveform = transmit_args->waveform;
+    for (size_t k=0; k<waveform->chunks.size(); k++) {
+        if (transmit_args->verbose)
+            printf("tx chunk: %6zu\n", k);
+
+        // a multi-packet send blocks for roughly its own air time
+        size_t n = waveform->chunks[k].num_samples;
+        double send_timeout = timeout + n / transmit_args->tx_rate;
+
+        // STREAMER API'S SEND METHOD
+        tx_event_log_push(transmit_args->events, TX_EVENT_SEND);
+        size_t sent = transmit_args->tx_stream->send(tx_waveform_buffs(waveform, k), n, md, send_timeout);
+        if (sent < n)
+            fprintf(stderr,"warning: tx chunk %zu, sent %zu of %zu samples\n", k, sent, n);
+
+        // only the first packet of a timed burst carries SOB/time
+        md.start_of_burst = false;
+        md.has_time_spec  = false;
+        timeout = 0.1;
+    } // chunk loop
  
     // send a mini EOB packet
     md.start_of_burst = false;
     md.end_of_burst   = true;
 
     // UPDATED SEND METHOD FROM STREAMER API
+    tx_event_log_push(transmit_args->events, TX_EVENT_EOB);
     transmit_args->tx_stream->send("", 0, md, 0.1);
+    tx_event_log_push(transmit_args->events, TX_EVENT_EOB_DONE);
+    transmit_args->send_ns = noctar_clock_ns() - t0;
 
     // sleep for a small amount of time to allow USRP buffers
     // to flush
     //usleep(100000);
 
 
-    /* trying to wait for async burst ACK - Not working... 
-    //std::cout << std::endl << "Waiting for async burst ACK... " << std::flush;
-    uhd::async_metadata_t async_md;
-    bool got_async_burst_ack = false;
-    //loop through all messages for the ACK packet (may have underflow messages in queue)
-    while (not got_async_burst_ack and transmit_args->usrp->get_device()->recv_async_msg(async_md, 0.1)){
-        got_async_burst_ack = (async_md.event_code == uhd::async_metadata_t::EVENT_CODE_BURST_ACK);
-    }
-    //std::cout << (got_async_burst_ack? "success" : "fail") << std::endl;
-    */
-
-    // turn on finished transmit flag
-    *(transmit_args->finished_transmitting) = true;
+    // the burst ACK (and any underflow) is picked up by the async monitor
 
     //finished
     //printf("usrp data transfer complete\n");
+    return NULL;
+}
+
+// retune / regain the usrp ahead of the burst: the tune and gain
+// commands are queued with a command time retune_guard ahead of the usrp
+// clock, so they take effect at a known device time instead of whenever
+// the control transactions happen to land; then the lo lock sensor is
+// polled to see when the synthesizer actually settled.  Returns false
+// (and touches nothing) if the burst keeps the current settings.
+bool retune(transmit_arg_struct *args) {
+    args->command_time = 0.0;
+    args->lock_time    = 0.0;
+    args->retune_ns    = 0;
+    bool tune = args->frequency > 0.0;
+    bool gain = !isnan(args->uhd_gain);
+    if (!tune && !gain)
+        return false;
+
+    uhd::usrp::multi_usrp::sptr usrp = args->usrp;
+    uhd::time_spec_t cmd = usrp->get_time_now() + uhd::time_spec_t(args->retune_guard);
+    args->command_time = cmd.get_real_secs();
+
+    uint64_t t0 = noctar_clock_ns();
+    usrp->set_command_time(cmd);
+    if (tune)
+        usrp->set_tx_freq(args->frequency);
+    if (gain)
+        usrp->set_tx_gain(args->uhd_gain);
+    usrp->clear_command_time();
+    args->retune_ns = noctar_clock_ns() - t0;
+
+    if (!tune)
+        return true;
+
+    // the sensor only means something once the command time has passed;
+    // give up after a few guard intervals (lock_time stays 0)
+    uhd::time_spec_t deadline = cmd + uhd::time_spec_t(4*args->retune_guard + 0.01);
+    try {
+        while (true) {
+            uhd::time_spec_t now = usrp->get_time_now();
+            if (now > deadline)
+                break;
+            if (now >= cmd && usrp->get_tx_sensor("lo_locked").to_bool()) {
+                args->lock_time = now.get_real_secs();
+                break;
+            }
+        }
+    } catch (const uhd::exception &e) {
+        // no lo_locked sensor on this daughterboard
+        if (args->verbose)
+            printf("retune: %s\n", e.what());
+    }
+    return true;
+}
+
+// capture_transform_func: channelize a chunk on the writer thread and
+// queue the channel samples for the decoder workers
+const char *channel_decode_process(void *ctx, const char *buf, size_t n,
+                                   unsigned long long offset, size_t *out_n) {
+    channel_decode_arg_struct *a = (channel_decode_arg_struct*)ctx;
+    const char *out = channelizer_process(a->chan, buf, n, offset, out_n);
+    if (a->decoder != NULL && *out_n > 0)
+        frame_decoder_push(a->decoder, (const short*)out, *out_n / 4);
+    return out;
 }
 
 void set_realtime_priority() {
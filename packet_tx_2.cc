@@ -42,12 +42,17 @@
 #include <sys/fcntl.h>
 #include <pthread.h>
 
+#include "noctar_capture.h"
+#include "noctar_config.h"
+#include "tx_waveform.h"
+#include "capture_sweep.h"
+#include "burst_detector.h"
+#include "tx_worker.h"
+
 struct transmit_arg_struct {
-    unsigned int num_frames;
     uhd::tx_streamer::sptr tx_stream;
-    std::vector<std::vector<std::complex<float> *> > buffs_vec;
+    const tx_waveform *waveform;    // pre-built burst
     uhd::tx_metadata_t md;
-    bool *finished_transmitting; 
     bool verbose;
 };
 
@@ -64,6 +69,17 @@ void usage() {
     printf("  g     : software tx gain [dB] (default: -6dB)\n");
     printf("  G     : uhd tx gain [dB] (default: 40dB)\n");
     printf("  N     : number of frames, default: 2000\n");
+    printf("  c     : capture config file (key = value), options after -c override it\n");
+    printf("  r     : samples per /dev/langford read, default: 256\n");
+    printf("  C     : capture chunk size [KiB] handed to the writer, default: 4096\n");
+    printf("  n     : number of chunks in the writer ring, default: 16\n");
+    printf("  A     : capture chunk alignment [bytes], default: page size\n");
+    printf("  D     : direct i/o capture writer, number of writes in flight (0: off), default: 0\n");
+    printf("  d     : burst detector window [samples] (0: off), default: 0\n");
+    printf("  t     : burst detector onset/end power ratio threshold, default: 10\n");
+    printf("  k     : number of bursts, each delta after the previous one ends, default: 2\n");
+    printf("  P     : pin the transmit worker to this cpu (it then busy-waits), default: none\n");
+    printf("  w     : sweep read sizes, report throughput and jitter, then exit\n");
 }
 
 int main (int argc, char **argv)
@@ -78,22 +94,42 @@ int main (int argc, char **argv)
     double frequency = 462.0e6;
     double bandwidth = 250e3f;
     unsigned int num_frames = 2000;     // number of frames to transmit
+    unsigned int num_bursts = 2;        // number of triggered bursts
     double txgain_dB = -12.0f;          // software tx gain [dB]
     double uhd_txgain = 40.0;           // uhd (hardware) tx gain
+    bool sweep = false;                 // run the read-size sweep and exit
+
+    // capture settings (read size, chunk size, ring depth, alignment)
+    capture_config capture_cfg;
+    capture_config_init(&capture_cfg, 256);
 
     //
     int d;
-    while ((d = getopt(argc,argv,"uhqvf:b:g:G:N:")) != EOF) {
+    while ((d = getopt(argc,argv,"uhqvk:f:b:g:G:N:c:r:C:n:A:D:d:t:P:w")) != EOF) {
         switch (d) {
         case 'u':
         case 'h':   usage();                        return 0;
         case 'q':   verbose     = false;            break;
         case 'v':   verbose     = true;             break;
+        case 'k':   num_bursts  = atoi(optarg);     break;
         case 'f':   frequency   = atof(optarg);     break;
         case 'b':   bandwidth   = atof(optarg);     break;
         case 'g':   txgain_dB   = atof(optarg);     break;
         case 'G':   uhd_txgain  = atof(optarg);     break;
         case 'N':   num_frames  = atoi(optarg);     break;
+        case 'c':
+            if (!capture_config_load(&capture_cfg, optarg))
+                exit(1);
+            break;
+        case 'r':   capture_cfg.read_samples = atoi(optarg);    break;
+        case 'C':   capture_cfg.chunk_kbytes = atoi(optarg);    break;
+        case 'n':   capture_cfg.ring_chunks  = atoi(optarg);    break;
+        case 'A':   capture_cfg.alignment    = atoi(optarg);    break;
+        case 'D':   capture_cfg.aio_depth    = atoi(optarg);    break;
+        case 'd':   capture_cfg.detect_window    = atoi(optarg);    break;
+        case 't':   capture_cfg.detect_threshold = atof(optarg);    break;
+        case 'P':   capture_cfg.tx_cpu           = atoi(optarg);    break;
+        case 'w':   sweep = true;                               break;
         default:
             usage();
             return 0;
@@ -108,6 +144,21 @@ int main (int argc, char **argv)
         exit(1);
     }
 
+    if (!capture_config_validate(&capture_cfg))
+        exit(1);
+    if (num_bursts == 0) {
+        fprintf(stderr,"error: %s, number of bursts must be positive\n", argv[0]);
+        exit(1);
+    }
+
+    // sweep capture read sizes without touching the usrp
+    if (sweep) {
+        FILE *sweep_log = fopen("./noctar_sweep.log", "w");
+        bool ok = capture_sweep(&capture_cfg, "/dev/langford", "./noctar_samples", sweep_log);
+        if (sweep_log) fclose(sweep_log);
+        return ok ? 0 : 1;
+    }
+
     uhd::device_addr_t dev_addr;
     //dev_addr["addr0"] = "192.168.10.2";
     //dev_addr["addr1"] = "192.168.10.3";
@@ -204,127 +255,132 @@ int main (int argc, char **argv)
     // generate the entire frame
     framegen64_execute(fg, header, payload, frame_samples);
 
-    // prepare buffs
-    //unsigned int num_buffers = frame_len / 256;
-    std::vector<std::vector<std::complex<float> *> > buffs_vec;
-    unsigned int usrp_sample_counter = 0;
-    std::vector<std::complex<float> > cur_usrp_buffer(256);
-    for (j=0; j<frame_len; j++) {
-        cur_usrp_buffer[usrp_sample_counter++] = g*frame_samples[j];
-        if (usrp_sample_counter == 256) {
-            usrp_sample_counter = 0;
-            std::vector<std::complex<float> > usrp_buffer(cur_usrp_buffer);
-            std::vector<std::complex<float> *> buffs(usrp->get_tx_num_channels(), &usrp_buffer.front());    
-            buffs_vec.push_back(buffs);
-        }
-    }
+    // prepare the whole scaled burst (num_frames copies of the frame) in
+    // one aligned buffer, cut into chunks the streamer can take per send
+    tx_waveform waveform;
+    if (!tx_waveform_create(&waveform, (size_t)num_frames*frame_len,
+                            usrp->get_tx_num_channels(), tx_stream->get_max_num_samps()))
+        exit(1);
+    for (j=0; j<frame_len; j++)
+        waveform.samples[j] = g*frame_samples[j];
+    for (unsigned int n=1; n<num_frames; n++)
+        memcpy(waveform.samples + (size_t)n*frame_len, waveform.samples, frame_len*sizeof(std::complex<float>));
 
 
     // open noctar device
     int fd_read = open("/dev/langford", O_RDONLY);
     // open file to write
-    int fd_write = open("./noctar_samples", O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR
-                                          | S_IWUSR | S_IROTH | S_IWOTH);
+    bool direct_io = capture_cfg.aio_depth > 0;
+    int fd_write = capture_open("./noctar_samples", O_WRONLY | O_CREAT | O_TRUNC,
+                                S_IRUSR | S_IWUSR | S_IROTH | S_IWOTH, &direct_io);
 
     // parameters for receive loop
-    unsigned int num_samples_to_read = 256;
+    unsigned int num_samples_to_read = capture_cfg.read_samples;
     unsigned int num_bytes_to_read = 4*num_samples_to_read;
-    char buff[num_bytes_to_read];
     //ssize_t num_read_samples = read(fd_read, buff, num_bytes_to_read);
     ssize_t num_read_bytes = 0;
     ssize_t num_read_samples = 0;
-    int64_t start_transmit = 0;
-    int64_t start_second_transmit = 0;
-    int64_t end_transmit = 0; 
-    int64_t end_second_transmit= 0;
+    std::vector<int64_t> start_transmit;    // per burst
+    std::vector<int64_t> end_transmit;      // per burst
+    start_transmit.reserve(num_bursts);
+    end_transmit.reserve(num_bursts);
     int64_t end_program = 0; 
     int64_t receive_sample_counter = 0;
     int64_t delta = 1 * (2.4e9)/32;// sample rate of noctar (2.4e9)/16
-    
-    // thread
-    pthread_t transmit_thread;
-    int iret; // return value of create thread
-    int iret2;
-
-    // status flags
-    bool transmitted = false;
-    bool finished_transmitting = false;
-    bool end_transmit_flag = false;
-    bool transmitted_second = false;
-    
+    int64_t next_transmit = delta;  // earliest start of the next burst
     
     // construct arguments for transmit function
     struct transmit_arg_struct transmit_args;
-    transmit_args.num_frames = num_frames;
     transmit_args.tx_stream = tx_stream;
-    transmit_args.buffs_vec = buffs_vec;
+    transmit_args.waveform = &waveform;
     transmit_args.md = md;
-    transmit_args.finished_transmitting = &finished_transmitting;
     transmit_args.verbose = verbose;
 
+    // transmit worker: created now and parked until each trigger, so no
+    // thread creation sits on the measured path
+    tx_worker worker;
+    if (!tx_worker_start(&worker, transmit, (void *)&transmit_args, capture_cfg.tx_cpu))
+        exit(1);
+
+    // capture ring: reads land back-to-back in large page-aligned chunks
+    // which a separate writer thread drains to disk
+    capture_writer writer;
+    size_t chunk_bytes = (size_t)capture_cfg.chunk_kbytes*1024;
+    if (chunk_bytes < num_bytes_to_read)
+        chunk_bytes = num_bytes_to_read;
+    if (!capture_writer_start(&writer, fd_write, chunk_bytes, capture_cfg.ring_chunks,
+                              direct_io, capture_cfg.aio_depth, capture_cfg.alignment))
+        exit(1);
+
+    // log file is opened up front so the burst detector can report live
+    std::ofstream log_file;
+    log_file.open("./noctar_samples.log");
+
+    // burst detection runs on the writer thread, ahead of the disk
+    burst_detector detector;
+    if (capture_cfg.detect_window > 0) {
+        burst_detector_init(&detector, capture_cfg.detect_window, capture_cfg.detect_threshold, &log_file);
+        capture_writer_set_process(&writer, burst_detector_process, &detector);
+    }
      
     ///////////// START COUNTER ////////////
     while(true) {
        
-        num_read_bytes = read(fd_read, buff, num_bytes_to_read);
+        num_read_bytes = capture_writer_read(&writer, fd_read, num_bytes_to_read);
+        if (num_read_bytes < 0) {
+            perror("read /dev/langford");
+            break;
+        }
 	num_read_samples = num_read_bytes / 4;
         receive_sample_counter += num_read_samples;
         
-        // transmit once
-        if (!transmitted && receive_sample_counter >= delta) {
-           transmitted = true;
-           start_transmit = receive_sample_counter;
-	   //std::cout << "start transmission: " << start_transmit << std::endl;
-              
-           // transmit with thread
-	   iret = pthread_create( &transmit_thread, NULL, transmit, (void *)&transmit_args);
-	   //transmit(num_frames, tx_stream, buffs_vec, md, &finished_transmitting, verbose);
-        }
-         // transmit second
-        if (end_transmit_flag && !transmitted_second && (receive_sample_counter > end_transmit + delta)) {
-           transmitted_second = true;
-           start_second_transmit = receive_sample_counter;
-           //std::cout << "start transmission: " << start_transmit << std::endl;
-
-           // transmit with thread
-           iret2 = pthread_create( &transmit_thread, NULL, transmit, (void *)&transmit_args);
-           //transmit(num_frames, tx_stream, buffs_vec, md, &finished_transmitting, verbose);
+        // transmit the next burst once the previous one has been done
+        // for delta samples
+        unsigned int num_started = start_transmit.size();
+        if (num_started < num_bursts && end_transmit.size() == num_started &&
+            receive_sample_counter >= next_transmit) {
+           start_transmit.push_back(receive_sample_counter);
+           //std::cout << "start transmission: " << receive_sample_counter << std::endl;
+
+           // wake the transmit worker
+           tx_worker_trigger(&worker);
         }
 
         // done transmitting? 
-        if (!end_transmit_flag && finished_transmitting) {
-            end_transmit_flag = true;
-	    end_transmit = receive_sample_counter;
-            finished_transmitting = false;
-	    //std::cout << "finished transmitting: " << end_transmit << std::endl;
-	    
+        if (end_transmit.size() < start_transmit.size() &&
+            tx_worker_done(&worker) > end_transmit.size()) {
+	    end_transmit.push_back(receive_sample_counter);
+            next_transmit = receive_sample_counter + delta;
+	    //std::cout << "finished transmitting: " << receive_sample_counter << std::endl;
         }
-	
-
-	if (end_transmit_flag && finished_transmitting) {
-            if (end_second_transmit == 0) {
-                end_second_transmit = receive_sample_counter;
-            }
-            // wait for delta before ending
-	    if (receive_sample_counter > end_second_transmit+delta) {
-	    	//std::cout << "end program: " << receive_sample_counter << std::endl;
-                end_program = receive_sample_counter;
-	    	break;
-	    }
+
+        // wait for delta after the last burst before ending
+	if (end_transmit.size() == num_bursts && receive_sample_counter > end_transmit.back()+delta) {
+	    //std::cout << "end program: " << receive_sample_counter << std::endl;
+            end_program = receive_sample_counter;
+	    break;
 	}
+    }
 
-	write(fd_write, buff, num_read_bytes);
+    tx_worker_stop(&worker);
 
-        
-    }
+    // flush the partially filled chunk and wait for the writer
+    capture_writer_stop(&writer);
+
+    tx_waveform_destroy(&waveform);
 
     // close noctar
     close(fd_read);
     close(fd_write);
     // write log
-    std::ofstream log_file;
-    log_file.open("./noctar_samples.log");
-    log_file << "start transmission: " << start_transmit << " finished transmitting: " << end_transmit << " end program: " << end_program << std::endl;
+    log_file << "start transmission: " << (start_transmit.empty() ? 0 : start_transmit[0]) << " finished transmitting: " << (end_transmit.empty() ? 0 : end_transmit[0]) << " end program: " << end_program << std::endl;
+    for (unsigned int b=0; b<start_transmit.size(); b++)
+        log_file << "transmission: " << b << " start: " << start_transmit[b] << " finished: " << (b < end_transmit.size() ? end_transmit[b] : 0) << std::endl;
+    log_file << "capture chunks written: " << writer.chunks_written << " bytes written: " << writer.bytes_written << " overflows: " << writer.overflows << " dropped bytes: " << writer.dropped_bytes << " max ring depth: " << writer.max_depth << " write errors: " << writer.write_errors << " direct i/o: " << (writer.direct ? "on" : "off") << " max writes in flight: " << writer.max_in_flight << std::endl;
+    if (capture_cfg.detect_window > 0) {
+        log_file << "burst detector window: " << detector.window << " threshold: " << detector.threshold << std::endl;
+        burst_write_table(log_file, detector.tracker.bursts);
+    }
     log_file.close();
 
     return 0;
@@ -337,17 +393,14 @@ void *transmit( void *args ) {
     transmit_arg_struct *transmit_args = (transmit_arg_struct*)args;
     uhd::tx_metadata_t md = transmit_args->md;
 
-    unsigned int pid;
-    for (pid=0; pid<transmit_args->num_frames; pid++) {
+    const tx_waveform *waveform = transmit_args->waveform;
+    for (size_t k=0; k<waveform->chunks.size(); k++) {
         if (transmit_args->verbose)
-            printf("tx packet id: %6u\n", pid);
-        
-	    // STREAMER API'S SEND METHOD
-            for (unsigned int k=0; k<transmit_args->buffs_vec.size(); k++) {
-              transmit_args->tx_stream->send(transmit_args->buffs_vec[k], 256, md, 0.1);
-            }
+            printf("tx chunk: %6zu\n", k);
 
-    } // packet loop
+        // STREAMER API'S SEND METHOD
+        transmit_args->tx_stream->send(tx_waveform_buffs(waveform, k), waveform->chunks[k].num_samples, md, 0.1);
+    } // chunk loop
  
     // send a mini EOB packet
     md.start_of_burst = false;
@@ -360,10 +413,8 @@ void *transmit( void *args ) {
     // to flush
     //usleep(100000);
 
-    // turn on finished transmit flag
-    *(transmit_args->finished_transmitting) = true;
-
     //finished
     //printf("usrp data transfer complete\n");
+    return NULL;
 }
 
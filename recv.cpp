@@ -16,6 +16,8 @@
 #include <iostream>
 #include <complex>
 
+#include "tx_waveform.h"
+
 namespace po = boost::program_options;
 
 
@@ -26,6 +28,14 @@ int main(int argc, char* argv[]) {
   } else {
     bytes_to_read = 32;
   }
+  // optional host (cpu) and over-the-wire sample formats
+  std::string cpu_format = argc > 2 ? argv[2] : "fc32";
+  std::string otw_format = argc > 3 ? argv[3] : "";
+  size_t sample_bytes = tx_format_sample_bytes(cpu_format.c_str());
+  if (sample_bytes == 0) {
+    std::cerr << "unsupported cpu format: " << cpu_format << std::endl;
+    return 1;
+  }
 
   std::string args = "addr=192.168.20.2";
 
@@ -54,7 +64,7 @@ int main(int argc, char* argv[]) {
   std::cout << boost::format("Actual TX Gain: %f...") % (usrp->get_tx_gain()) << std::endl << std::endl;
 
   //create a transmit streamer
-  uhd::stream_args_t stream_args("fc32"); //complex floats
+  uhd::stream_args_t stream_args(cpu_format, otw_format);
   uhd::tx_streamer::sptr tx_stream = usrp->get_tx_stream(stream_args);
 
   float ampl = float(0.3);
@@ -62,8 +72,16 @@ int main(int argc, char* argv[]) {
   const size_t spb = tx_stream->get_max_num_samps();
   std::cout << "buffer size: " << spb << std::endl;
 
-  std::vector<std::complex<float> > buff(spb, std::complex<float>(ampl, ampl));
-  std::vector<std::complex<float> *> buffs(usrp->get_tx_num_channels(), &buff.front());
+  // buffer is quantized to the cpu format once, here
+  std::vector<std::complex<float> > buff_fc32(spb, std::complex<float>(ampl, ampl));
+  std::vector<char> buff(spb * sample_bytes);
+  if (cpu_format == "sc16")
+    tx_convert_cf32_sc16((const float*)&buff_fc32.front(), (short*)&buff.front(), 32767.0f, 2*spb);
+  else if (cpu_format == "sc8")
+    tx_convert_cf32_sc8_sse2((const float*)&buff_fc32.front(), (signed char*)&buff.front(), 127.0f, 2*spb);
+  else
+    memcpy(&buff.front(), &buff_fc32.front(), spb * sample_bytes);
+  std::vector<const void *> buffs(usrp->get_tx_num_channels(), &buff.front());
 
   //setup metadata for the first packet
   uhd::tx_metadata_t md;
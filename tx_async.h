@@ -0,0 +1,158 @@
+/*
+ * tx_async.h
+ *
+ * transmit async message monitor
+ *
+ * A thread drains device->recv_async_msg() for the whole run, so burst
+ * ACKs, underflows, sequence and time errors are never left queued in
+ * the device.  Every message is stamped with CLOCK_MONOTONIC_RAW (and
+ * the device time, when the message carries one), appended to a
+ * pre-allocated event list and counted per event code.  The number of
+ * burst ACKs is published lock-free, so the receive loop can take the
+ * end of a burst from the device rather than from send() returning.
+ */
+
+#ifndef __TX_ASYNC_H__
+#define __TX_ASYNC_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ostream>
+#include <vector>
+
+#include <uhd/device.hpp>
+#include <uhd/types/metadata.hpp>
+
+#include "tx_timestamps.h"
+
+// one counter per async_metadata_t::event_code bit
+#define TX_ASYNC_NUM_CODES 7
+
+inline const char *tx_async_code_name(unsigned int _bit)
+{
+    switch (1u << _bit) {
+    case uhd::async_metadata_t::EVENT_CODE_BURST_ACK:              return "burst_ack";
+    case uhd::async_metadata_t::EVENT_CODE_UNDERFLOW:              return "underflow";
+    case uhd::async_metadata_t::EVENT_CODE_SEQ_ERROR:              return "seq_error";
+    case uhd::async_metadata_t::EVENT_CODE_TIME_ERROR:             return "time_error";
+    case uhd::async_metadata_t::EVENT_CODE_UNDERFLOW_IN_PACKET:    return "underflow_in_packet";
+    case uhd::async_metadata_t::EVENT_CODE_SEQ_ERROR_IN_BURST:     return "seq_error_in_burst";
+    case uhd::async_metadata_t::EVENT_CODE_USER_PAYLOAD:           return "user_payload";
+    default:                                                       return "unknown";
+    }
+}
+
+struct tx_async_event {
+    int code;                   // async_metadata_t::event_code
+    size_t channel;
+    uint64_t ns;                // CLOCK_MONOTONIC_RAW at reception
+    double device_time;         // device time of the event [s] (-1: none)
+};
+
+struct tx_async_monitor {
+    uhd::device::sptr device;
+
+    std::vector<tx_async_event> events;     // pre-allocated, never resized
+    unsigned int num_events;
+    unsigned int lost;                      // events past the capacity
+    unsigned int counts[TX_ASYNC_NUM_CODES];
+
+    unsigned int burst_acks;                // published to the receive loop
+    uint64_t first_ack_ns;                  // CLOCK_MONOTONIC_RAW of the first ACK
+
+    int quit;
+    pthread_t thread;
+};
+
+inline void *tx_async_monitor_thread(void *_arg)
+{
+    tx_async_monitor *m = (tx_async_monitor*)_arg;
+    uhd::async_metadata_t md;
+
+    while (!__atomic_load_n(&m->quit, __ATOMIC_ACQUIRE)) {
+        // short timeout so stop() is noticed quickly
+        if (!m->device->recv_async_msg(md, 0.01))
+            continue;
+        uint64_t ns = noctar_clock_ns();
+
+        for (unsigned int b=0; b<TX_ASYNC_NUM_CODES; b++) {
+            if (md.event_code & (1u << b))
+                m->counts[b]++;
+        }
+
+        if (m->num_events < m->events.size()) {
+            tx_async_event &e = m->events[m->num_events++];
+            e.code        = md.event_code;
+            e.channel     = md.channel;
+            e.ns          = ns;
+            e.device_time = md.has_time_spec ? md.time_spec.get_real_secs() : -1.0;
+        } else {
+            m->lost++;
+        }
+
+        if (md.event_code & uhd::async_metadata_t::EVENT_CODE_BURST_ACK) {
+            if (m->burst_acks == 0)
+                m->first_ack_ns = ns;
+            __atomic_store_n(&m->burst_acks, m->burst_acks + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+inline bool tx_async_monitor_start(tx_async_monitor *_m,
+                                   uhd::device::sptr _device,
+                                   unsigned int _capacity)
+{
+    _m->device = _device;
+    _m->events.resize(_capacity);
+    _m->num_events = 0;
+    _m->lost       = 0;
+    for (unsigned int b=0; b<TX_ASYNC_NUM_CODES; b++)
+        _m->counts[b] = 0;
+    _m->burst_acks   = 0;
+    _m->first_ack_ns = 0;
+    _m->quit = 0;
+
+    if (pthread_create(&_m->thread, NULL, tx_async_monitor_thread, (void*)_m) != 0) {
+        fprintf(stderr,"error: could not create tx async monitor\n");
+        return false;
+    }
+    return true;
+}
+
+// number of burst ACKs received so far
+inline unsigned int tx_async_monitor_acks(tx_async_monitor *_m)
+{
+    return __atomic_load_n(&_m->burst_acks, __ATOMIC_ACQUIRE);
+}
+
+inline void tx_async_monitor_stop(tx_async_monitor *_m)
+{
+    __atomic_store_n(&_m->quit, 1, __ATOMIC_RELEASE);
+    pthread_join(_m->thread, NULL);
+}
+
+// counts per event code, then one line per event
+inline void tx_async_monitor_write(std::ostream &_os, const tx_async_monitor *_m)
+{
+    _os << "tx async events: " << _m->num_events << " lost: " << _m->lost;
+    for (unsigned int b=0; b<TX_ASYNC_NUM_CODES; b++)
+        _os << " " << tx_async_code_name(b) << ": " << _m->counts[b];
+    _os << std::endl;
+
+    for (unsigned int i=0; i<_m->num_events; i++) {
+        const tx_async_event &e = _m->events[i];
+        _os << "tx async event: ";
+        for (unsigned int b=0; b<TX_ASYNC_NUM_CODES; b++) {
+            if (e.code & (1u << b))
+                _os << tx_async_code_name(b) << " ";
+        }
+        _os << "channel: " << e.channel << " ns: " << e.ns << " device time: ";
+        if (e.device_time >= 0.0) _os << std::fixed << e.device_time << std::defaultfloat;
+        else                      _os << "none";
+        _os << std::endl;
+    }
+}
+
+#endif // __TX_ASYNC_H__
@@ -0,0 +1,242 @@
+/*
+ * tx_convert.h
+ *
+ * gain scaling and fc32 -> sc16/sc8 conversion of transmit samples
+ *
+ * Both operations work on interleaved I/Q floats, so a complex sample is
+ * just two lanes.  Each has an SSE2 kernel (with a scalar tail) and an
+ * AVX/AVX2 kernel selected at run time, like the magnitude kernels in
+ * burst_detector.h.  The sc16 conversion rounds to nearest and saturates
+ * to [-32767, 32767], matching what the UHD converter does with
+ * fc32 * 32767; sc8 likewise saturates to [-127, 127] (SSE2 only, it is
+ * only run once per waveform).  tx_convert_parallel() splits long
+ * waveforms across threads on 64-byte boundaries.
+ */
+
+#ifndef __TX_CONVERT_H__
+#define __TX_CONVERT_H__
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+// y = g*x for _n floats (2 per complex sample); _y may equal _x
+inline void tx_scale_cf32_sse2(const float *_x, float *_y, float _g, size_t _n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128 g = _mm_set1_ps(_g);
+    size_t n4 = _n & ~(size_t)3;
+    for (; i < n4; i += 4)
+        _mm_storeu_ps(_y + i, _mm_mul_ps(_mm_loadu_ps(_x + i), g));
+#endif
+    for (; i < _n; i++)
+        _y[i] = _g * _x[i];
+}
+
+// round and saturate one value to sc16
+inline short tx_convert_sample_sc16(float _x)
+{
+    if (_x >  32767.0f) _x =  32767.0f;
+    if (_x < -32767.0f) _x = -32767.0f;
+    return (short)lrintf(_x);
+}
+
+// y = sat16(round(g*x)) for _n floats
+inline void tx_convert_cf32_sc16_sse2(const float *_x, short *_y, float _g, size_t _n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    // clamp before converting: cvtps gives 0x80000000 for anything out
+    // of int32 range, which would saturate to the wrong rail
+    const __m128 g  = _mm_set1_ps(_g);
+    const __m128 hi = _mm_set1_ps( 32767.0f);
+    const __m128 lo = _mm_set1_ps(-32767.0f);
+    for (; i + 8 <= _n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(_x + i),     g);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(_x + i + 4), g);
+        a = _mm_max_ps(_mm_min_ps(a, hi), lo);
+        b = _mm_max_ps(_mm_min_ps(b, hi), lo);
+        __m128i v = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+        _mm_storeu_si128((__m128i*)(_y + i), v);
+    }
+#endif
+    for (; i < _n; i++)
+        _y[i] = tx_convert_sample_sc16(_g * _x[i]);
+}
+
+// round and saturate one value to sc8
+inline signed char tx_convert_sample_sc8(float _x)
+{
+    if (_x >  127.0f) _x =  127.0f;
+    if (_x < -127.0f) _x = -127.0f;
+    return (signed char)lrintf(_x);
+}
+
+// y = sat8(round(g*x)) for _n floats
+inline void tx_convert_cf32_sc8_sse2(const float *_x, signed char *_y, float _g, size_t _n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128 g  = _mm_set1_ps(_g);
+    const __m128 hi = _mm_set1_ps( 127.0f);
+    const __m128 lo = _mm_set1_ps(-127.0f);
+    for (; i + 16 <= _n; i += 16) {
+        __m128i v[4];
+        for (unsigned int k=0; k<4; k++) {
+            __m128 a = _mm_mul_ps(_mm_loadu_ps(_x + i + 4*k), g);
+            v[k] = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(a, hi), lo));
+        }
+        __m128i w = _mm_packs_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+        _mm_storeu_si128((__m128i*)(_y + i), w);
+    }
+#endif
+    for (; i < _n; i++)
+        _y[i] = tx_convert_sample_sc8(_g * _x[i]);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TX_HAVE_AVX2_KERNEL 1
+
+// AVX version of the scaling: eight floats per iteration
+__attribute__((target("avx")))
+inline void tx_scale_cf32_avx(const float *_x, float *_y, float _g, size_t _n)
+{
+    size_t i = 0;
+    const __m256 g = _mm256_set1_ps(_g);
+    for (; i + 8 <= _n; i += 8)
+        _mm256_storeu_ps(_y + i, _mm256_mul_ps(_mm256_loadu_ps(_x + i), g));
+    tx_scale_cf32_sse2(_x + i, _y + i, _g, _n - i);
+}
+
+// AVX2 version of the conversion: sixteen floats per iteration; packs
+// works per 128-bit lane, so the 64-bit quarters are put back in order
+__attribute__((target("avx2")))
+inline void tx_convert_cf32_sc16_avx2(const float *_x, short *_y, float _g, size_t _n)
+{
+    size_t i = 0;
+    const __m256 g  = _mm256_set1_ps(_g);
+    const __m256 hi = _mm256_set1_ps( 32767.0f);
+    const __m256 lo = _mm256_set1_ps(-32767.0f);
+    for (; i + 16 <= _n; i += 16) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(_x + i),     g);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(_x + i + 8), g);
+        a = _mm256_max_ps(_mm256_min_ps(a, hi), lo);
+        b = _mm256_max_ps(_mm256_min_ps(b, hi), lo);
+        __m256i v = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+        v = _mm256_permute4x64_epi64(v, 0xd8);
+        _mm256_storeu_si256((__m256i*)(_y + i), v);
+    }
+    tx_convert_cf32_sc16_sse2(_x + i, _y + i, _g, _n - i);
+}
+#endif
+
+// y = g*x, using the widest kernel the cpu supports
+inline void tx_scale_cf32(const float *_x, float *_y, float _g, size_t _n)
+{
+#ifdef TX_HAVE_AVX2_KERNEL
+    static const bool have_avx = __builtin_cpu_supports("avx");
+    if (have_avx) {
+        tx_scale_cf32_avx(_x, _y, _g, _n);
+        return;
+    }
+#endif
+    tx_scale_cf32_sse2(_x, _y, _g, _n);
+}
+
+// y = sat16(round(g*x)), using the widest kernel the cpu supports
+inline void tx_convert_cf32_sc16(const float *_x, short *_y, float _g, size_t _n)
+{
+#ifdef TX_HAVE_AVX2_KERNEL
+    static const bool have_avx2 = __builtin_cpu_supports("avx2");
+    if (have_avx2) {
+        tx_convert_cf32_sc16_avx2(_x, _y, _g, _n);
+        return;
+    }
+#endif
+    tx_convert_cf32_sc16_sse2(_x, _y, _g, _n);
+}
+
+enum tx_convert_op {
+    TX_CONVERT_SCALE_CF32 = 0,  // float out
+    TX_CONVERT_CF32_SC16,       // short out
+    TX_CONVERT_CF32_SC8         // signed char out
+};
+
+struct tx_convert_arg_struct {
+    int op;                     // tx_convert_op
+    const float *x;
+    void *y;
+    float gain;
+    size_t begin;               // first float
+    size_t end;                 // one past the last float
+};
+
+inline void *tx_convert_range(void *_arg)
+{
+    tx_convert_arg_struct *a = (tx_convert_arg_struct*)_arg;
+    size_t n = a->end - a->begin;
+    if (a->op == TX_CONVERT_CF32_SC16)
+        tx_convert_cf32_sc16(a->x + a->begin, (short*)a->y + a->begin, a->gain, n);
+    else if (a->op == TX_CONVERT_CF32_SC8)
+        tx_convert_cf32_sc8_sse2(a->x + a->begin, (signed char*)a->y + a->begin, a->gain, n);
+    else
+        tx_scale_cf32(a->x + a->begin, (float*)a->y + a->begin, a->gain, n);
+    return NULL;
+}
+
+// run _op over _n floats on up to _num_threads threads; every range
+// but the last starts on a 64-byte boundary of the input (and of the
+// output for fc32/sc16)
+inline void tx_convert_parallel(int _op,
+                                const float *_x,
+                                void *_y,
+                                float _gain,
+                                size_t _n,
+                                unsigned int _num_threads)
+{
+    const size_t quantum = 16;  // floats: 64 bytes in, 16, 32 or 64 out
+    size_t num_quanta = (_n + quantum - 1) / quantum;
+    if (_num_threads == 0)
+        _num_threads = 1;
+    if (_num_threads > num_quanta)
+        _num_threads = num_quanta > 0 ? num_quanta : 1;
+
+    std::vector<tx_convert_arg_struct> args(_num_threads);
+    std::vector<pthread_t> threads(_num_threads);
+    std::vector<bool> started(_num_threads, false);
+    for (unsigned int t=0; t<_num_threads; t++) {
+        tx_convert_arg_struct &a = args[t];
+        a.op    = _op;
+        a.x     = _x;
+        a.y     = _y;
+        a.gain  = _gain;
+        a.begin = quantum * (num_quanta * t / _num_threads);
+        a.end   = quantum * (num_quanta * (t+1) / _num_threads);
+        if (a.end > _n)
+            a.end = _n;
+        if (t > 0)
+            started[t] = pthread_create(&threads[t], NULL, tx_convert_range, (void*)&a) == 0;
+    }
+
+    // the calling thread takes the first range, and any range whose
+    // thread could not be created
+    tx_convert_range((void*)&args[0]);
+    for (unsigned int t=1; t<_num_threads; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        else
+            tx_convert_range((void*)&args[t]);
+    }
+}
+
+#endif // __TX_CONVERT_H__
@@ -0,0 +1,148 @@
+/*
+ * tx_convert_bench.cc
+ *
+ * micro-benchmark of the transmit sample preparation in tx_convert.h
+ *
+ * Times the scalar loop packet_tx used to scale frame samples by the
+ * gain against the SIMD kernels, single- and multi-threaded, for both
+ * the fc32 scaling and the fc32 -> sc16 conversion, and checks that the
+ * kernels give the same samples as the scalar code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <complex>
+#include <vector>
+
+#include "tx_convert.h"
+#include "tx_timestamps.h"
+#include "tx_waveform.h"
+
+void usage() {
+    printf("tx_convert_bench -- benchmark tx gain scaling and sc16 conversion\n");
+    printf("\n");
+    printf("  u,h   : usage/help\n");
+    printf("  n     : number of complex samples, default: 2680000 (2000 frame64 frames)\n");
+    printf("  r     : repetitions per variant (best is reported), default: 20\n");
+    printf("  j     : number of threads for the parallel variants, default: number of cpus\n");
+    printf("  g     : gain [dB], default: -12\n");
+}
+
+// the original prep loop: one std::complex<float> at a time
+void scale_scalar(const std::complex<float> *_x, std::complex<float> *_y, float _g, size_t _n)
+{
+    for (size_t i=0; i<_n; i++)
+        _y[i] = _g*_x[i];
+}
+
+void convert_scalar(const std::complex<float> *_x, short *_y, float _g, size_t _n)
+{
+    for (size_t i=0; i<_n; i++) {
+        std::complex<float> v = _g*_x[i];
+        _y[2*i]   = tx_convert_sample_sc16(v.real());
+        _y[2*i+1] = tx_convert_sample_sc16(v.imag());
+    }
+}
+
+void report(const char *_name, uint64_t _best_ns, size_t _n, uint64_t _base_ns)
+{
+    double s = _best_ns * 1e-9;
+    printf("%-26s:   %10.3f ms   %10.2f Msamples/s   %6.2fx\n",
+            _name, s*1e3, _n / s * 1e-6, (double)_base_ns / _best_ns);
+}
+
+int main (int argc, char **argv)
+{
+    size_t num_samples = 2000*1340;
+    unsigned int repetitions = 20;
+    unsigned int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    float gain_dB = -12.0f;
+
+    int d;
+    while ((d = getopt(argc,argv,"uhn:r:j:g:")) != EOF) {
+        switch (d) {
+        case 'u':
+        case 'h':   usage();                            return 0;
+        case 'n':   num_samples = strtoull(optarg,NULL,0); break;
+        case 'r':   repetitions = atoi(optarg);         break;
+        case 'j':   num_threads = atoi(optarg);         break;
+        case 'g':   gain_dB     = atof(optarg);         break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (num_samples == 0 || repetitions == 0) {
+        fprintf(stderr,"error: %s, sample and repetition counts must be positive\n", argv[0]);
+        exit(1);
+    }
+    float g = powf(10.0f, gain_dB/20.0f);
+
+    // aligned buffers, as packet_tx uses them
+    tx_waveform x, y, ref;
+    if (!tx_waveform_create(&x,   num_samples, 1, num_samples) ||
+        !tx_waveform_create(&y,   num_samples, 1, num_samples) ||
+        !tx_waveform_create(&ref, num_samples, 1, num_samples))
+        exit(1);
+    std::vector<short> y16(2*num_samples), ref16(2*num_samples);
+
+    // frame64-like levels, with a few samples past full scale to
+    // exercise saturation
+    unsigned int state = 1;
+    for (size_t i=0; i<num_samples; i++) {
+        float re = (float)rand_r(&state) / RAND_MAX * 2.0f - 1.0f;
+        float im = (float)rand_r(&state) / RAND_MAX * 2.0f - 1.0f;
+        if (i % 4099 == 0) { re *= 8.0f; im *= -8.0f; }
+        x.samples[i] = std::complex<float>(re, im);
+    }
+    const float *xf = (const float*)x.samples;
+    size_t n = 2*num_samples;
+    float g16 = g * 32767.0f;   // sc16 full scale, as in the UHD converter
+
+    printf("samples     :   %zu\n", num_samples);
+    printf("threads     :   %u\n", num_threads);
+    printf("gain        :   %f\n", g);
+
+    uint64_t best[6];
+    bool mismatch = false;
+    for (unsigned int v=0; v<6; v++) {
+        best[v] = ~0ull;
+        for (unsigned int r=0; r<repetitions; r++) {
+            uint64_t t0 = noctar_clock_ns();
+            switch (v) {
+            case 0: scale_scalar(x.samples, ref.samples, g, num_samples);                   break;
+            case 1: tx_scale_cf32(xf, (float*)y.samples, g, n);                             break;
+            case 2: tx_convert_parallel(TX_CONVERT_SCALE_CF32, xf, y.samples, g, n, num_threads); break;
+            case 3: convert_scalar(x.samples, &ref16[0], g16, num_samples);                 break;
+            case 4: tx_convert_cf32_sc16(xf, &y16[0], g16, n);                              break;
+            case 5: tx_convert_parallel(TX_CONVERT_CF32_SC16, xf, &y16[0], g16, n, num_threads); break;
+            }
+            uint64_t dt = noctar_clock_ns() - t0;
+            if (dt < best[v])
+                best[v] = dt;
+        }
+        if ((v == 1 || v == 2) && memcmp(y.samples, ref.samples, n*sizeof(float)) != 0) {
+            printf("error: fc32 variant %u differs from the scalar loop\n", v);
+            mismatch = true;
+        }
+        if ((v == 4 || v == 5) && memcmp(&y16[0], &ref16[0], n*sizeof(short)) != 0) {
+            printf("error: sc16 variant %u differs from the scalar loop\n", v);
+            mismatch = true;
+        }
+    }
+
+    report("fc32 scale, scalar",     best[0], num_samples, best[0]);
+    report("fc32 scale, simd",       best[1], num_samples, best[0]);
+    report("fc32 scale, simd+threads", best[2], num_samples, best[0]);
+    report("sc16 convert, scalar",   best[3], num_samples, best[3]);
+    report("sc16 convert, simd",     best[4], num_samples, best[3]);
+    report("sc16 convert, simd+threads", best[5], num_samples, best[3]);
+
+    tx_waveform_destroy(&x);
+    tx_waveform_destroy(&y);
+    tx_waveform_destroy(&ref);
+    return mismatch ? 1 : 0;
+}
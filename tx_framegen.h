@@ -0,0 +1,125 @@
+/*
+ * tx_framegen.h
+ *
+ * parallel frame64 library generation
+ *
+ * Builds a library of distinct framegen64 frames ahead of the trigger:
+ * frame n carries packet id n in the first two header bytes and a
+ * pseudo-random header tail and payload drawn from a per-frame seed, so
+ * the library is the same whatever the thread count.  The frames are
+ * split into contiguous ranges, one per thread, each with its own
+ * framegen64 object, and written back-to-back (FRAME64_LEN samples each)
+ * straight into the caller's arena, already scaled by the tx gain.
+ * tx_framegen_burst() fills a whole fc32 burst this way, repeating the
+ * library when the burst holds more frames than it.
+ */
+
+#ifndef __TX_FRAMEGEN_H__
+#define __TX_FRAMEGEN_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <complex>
+#include <vector>
+#include <liquid/liquid.h>
+
+#include "tx_convert.h"
+#include "tx_waveform.h"
+
+// the frame index travels in the first two header bytes, so at most
+// this many frames can be told apart at the receiver
+#define TX_FRAMEGEN_MAX_DISTINCT 65536u
+
+struct tx_framegen_arg_struct {
+    std::complex<float> *frames;    // arena, frame n at n*FRAME64_LEN
+    unsigned int begin;             // first frame
+    unsigned int end;               // one past the last frame
+    float gain;
+    unsigned int seed;
+};
+
+inline void *tx_framegen_range(void *_arg)
+{
+    tx_framegen_arg_struct *a = (tx_framegen_arg_struct*)_arg;
+    framegen64 fg = framegen64_create();
+
+    unsigned char header[8];
+    unsigned char payload[64];
+    for (unsigned int n=a->begin; n<a->end; n++) {
+        unsigned int state = a->seed ^ (n * 2654435761u);
+        header[0] = (n >> 8) & 0xff;
+        header[1] = (n     ) & 0xff;
+        for (unsigned int j=2; j<8; j++)
+            header[j] = rand_r(&state) & 0xff;
+        for (unsigned int j=0; j<64; j++)
+            payload[j] = rand_r(&state) & 0xff;
+
+        std::complex<float> *y = a->frames + (size_t)n*FRAME64_LEN;
+        framegen64_execute(fg, header, payload, y);
+        tx_scale_cf32((const float*)y, (float*)y, a->gain, 2*FRAME64_LEN);
+    }
+
+    framegen64_destroy(fg);
+    return NULL;
+}
+
+// generate _num_frames frames into _frames using up to _num_threads
+// threads
+inline void tx_framegen_library(std::complex<float> *_frames,
+                                unsigned int _num_frames,
+                                float _gain,
+                                unsigned int _seed,
+                                unsigned int _num_threads)
+{
+    if (_num_threads == 0)
+        _num_threads = 1;
+    if (_num_threads > _num_frames)
+        _num_threads = _num_frames;
+
+    std::vector<tx_framegen_arg_struct> args(_num_threads);
+    std::vector<pthread_t> threads(_num_threads);
+    std::vector<bool> started(_num_threads, false);
+    for (unsigned int t=0; t<_num_threads; t++) {
+        args[t].frames = _frames;
+        args[t].begin  = (unsigned long long)_num_frames * t / _num_threads;
+        args[t].end    = (unsigned long long)_num_frames * (t+1) / _num_threads;
+        args[t].gain   = _gain;
+        args[t].seed   = _seed;
+        started[t] = pthread_create(&threads[t], NULL, tx_framegen_range, (void*)&args[t]) == 0;
+    }
+
+    // run any range whose thread could not be created here
+    for (unsigned int t=0; t<_num_threads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        } else {
+            fprintf(stderr,"warning: tx_framegen_library(), generating frames %u..%u inline\n",
+                    args[t].begin, args[t].end);
+            tx_framegen_range((void*)&args[t]);
+        }
+    }
+}
+
+// fill the fc32 burst of _w (_num_frames frames long) with _num_distinct
+// distinct frames, repeated in order (0: all frames distinct, up to
+// TX_FRAMEGEN_MAX_DISTINCT)
+inline void tx_framegen_burst(tx_waveform *_w,
+                              unsigned int _num_frames,
+                              unsigned int _num_distinct,
+                              float _gain,
+                              unsigned int _seed,
+                              unsigned int _num_threads)
+{
+    if (_num_distinct == 0 || _num_distinct > _num_frames)
+        _num_distinct = _num_frames;
+    if (_num_distinct > TX_FRAMEGEN_MAX_DISTINCT)
+        _num_distinct = TX_FRAMEGEN_MAX_DISTINCT;
+    tx_framegen_library(_w->samples, _num_distinct, _gain, _seed, _num_threads);
+    for (unsigned int n=_num_distinct; n<_num_frames; n++)
+        memcpy(_w->samples + (size_t)n*FRAME64_LEN,
+               _w->samples + (size_t)(n % _num_distinct)*FRAME64_LEN,
+               FRAME64_LEN*sizeof(std::complex<float>));
+}
+
+#endif // __TX_FRAMEGEN_H__
@@ -0,0 +1,179 @@
+/*
+ * tx_schedule.h
+ *
+ * burst schedule for packet_tx
+ *
+ * A schedule is a list of bursts executed in order by one process, so a
+ * single capture can hold many latency trials.  Each line of a schedule
+ * file describes one burst ('#' starts a comment):
+ *
+ *     <start> [frames [gain_dB [repeat]]] [f=<Hz>] [G=<dB>]
+ *
+ * where <start> is either a gap in Noctar samples after the previous
+ * burst ended (after the start of the capture for the first burst), or
+ * '@' followed by an absolute usrp time in seconds (the usrp clock is
+ * zeroed at startup) at which the burst is sent as a timed burst; such a
+ * burst is armed as soon as the previous one has ended.  Missing fields
+ * take the command-line frame count and gain; repeat (default 1) adds
+ * the same line several times.  f= and G= retune the usrp (center
+ * frequency, uhd gain) before the burst with timed commands; a sweep
+ * (tx_schedule_sweep) repeats the whole schedule once per frequency.
+ */
+
+#ifndef __TX_SCHEDULE_H__
+#define __TX_SCHEDULE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+
+enum tx_burst_start_type {
+    TX_BURST_AFTER_GAP = 0,     // start: Noctar samples after the previous end
+    TX_BURST_AT_TIME            // start: absolute usrp time [s]
+};
+
+struct tx_burst_entry {
+    int type;                   // tx_burst_start_type
+    double start;               // gap [samples] or usrp time [s]
+    unsigned int num_frames;
+    float gain_dB;              // software tx gain
+    double frequency;           // retune to this center frequency [Hz] (0: keep)
+    double uhd_gain;            // set this uhd gain [dB] (NAN: keep)
+    unsigned int waveform;      // index of the pre-built waveform
+};
+
+// true if the usrp is retuned before burst _e
+inline bool tx_burst_retunes(const tx_burst_entry &_e)
+{
+    return _e.frequency > 0.0 || !isnan(_e.uhd_gain);
+}
+
+// what happened to one burst
+struct tx_burst_result {
+    int64_t start;              // sample at the trigger
+    int64_t send_done;          // sample when send() of the EOB returned
+    int64_t end;                // sample at the burst ACK (or fallback)
+    bool acked;                 // end came from a burst ACK
+    uint64_t trigger_ns;        // CLOCK_MONOTONIC_RAW at the trigger
+    double armed_time;          // usrp time when a timed burst was armed [s]
+    double scheduled_time;      // usrp time it was scheduled for [s] (0: untimed)
+    uint64_t send_ns;           // first send() call to EOB return
+
+    // retune (tx_burst_retunes)
+    double command_time;        // usrp time the tune/gain commands apply [s]
+    double lock_time;           // usrp time the lo was seen locked [s] (0: not seen)
+    uint64_t retune_ns;         // host time spent issuing the commands
+};
+
+// load a schedule file; returns false if it cannot be read or holds no
+// bursts
+inline bool tx_schedule_load(std::vector<tx_burst_entry> *_s,
+                             const char *_filename,
+                             unsigned int _num_frames,
+                             float _gain_dB)
+{
+    FILE *fid = fopen(_filename, "r");
+    if (fid == NULL) {
+        fprintf(stderr,"error: could not open burst schedule '%s'\n", _filename);
+        return false;
+    }
+
+    char line[1024];
+    unsigned int lineno = 0;
+    while (fgets(line, sizeof(line), fid) != NULL) {
+        lineno++;
+        char *c = strchr(line, '#');
+        if (c) *c = '\0';
+
+        // positional fields, then key=value retune fields
+        tx_burst_entry e;
+        unsigned int repeat = 1;
+        e.num_frames = _num_frames;
+        e.gain_dB    = _gain_dB;
+        e.frequency  = 0.0;
+        e.uhd_gain   = NAN;
+        e.waveform   = 0;
+        unsigned int field = 0;
+        bool ok = true;
+        for (char *tok = strtok(line, " \t\r\n"); tok != NULL && ok; tok = strtok(NULL, " \t\r\n")) {
+            char *end;
+            if      (strncmp(tok, "f=", 2) == 0) { e.frequency = strtod(tok + 2, &end); ok = *end == '\0' && e.frequency > 0.0; }
+            else if (strncmp(tok, "G=", 2) == 0) { e.uhd_gain  = strtod(tok + 2, &end); ok = *end == '\0'; }
+            else if (field == 0) {
+                e.type  = tok[0] == '@' ? TX_BURST_AT_TIME : TX_BURST_AFTER_GAP;
+                e.start = strtod(tok[0] == '@' ? tok + 1 : tok, &end);
+                ok = *end == '\0' && e.start >= 0.0;
+                field++;
+            }
+            else if (field == 1) { e.num_frames = strtoul(tok, &end, 0); ok = *end == '\0' && e.num_frames > 0; field++; }
+            else if (field == 2) { e.gain_dB    = strtod(tok, &end);     ok = *end == '\0'; field++; }
+            else if (field == 3) { repeat       = strtoul(tok, &end, 0); ok = *end == '\0'; field++; }
+            else ok = false;
+        }
+        if (field == 0 && ok)
+            continue;
+        if (!ok || field == 0) {
+            fprintf(stderr,"warning: %s:%u, expected '<gap|@time> [frames [gain_dB [repeat]]] [f=<Hz>] [G=<dB>]'\n", _filename, lineno);
+            continue;
+        }
+        for (unsigned int r=0; r<repeat; r++)
+            _s->push_back(e);
+    }
+    fclose(fid);
+
+    if (_s->empty()) {
+        fprintf(stderr,"error: burst schedule '%s' holds no bursts\n", _filename);
+        return false;
+    }
+    return true;
+}
+
+// true if any burst is sent at an absolute usrp time
+inline bool tx_schedule_timed(const std::vector<tx_burst_entry> &_s)
+{
+    for (unsigned int i=0; i<_s.size(); i++) {
+        if (_s[i].type == TX_BURST_AT_TIME)
+            return true;
+    }
+    return false;
+}
+
+// true if any burst retunes the usrp
+inline bool tx_schedule_retunes(const std::vector<tx_burst_entry> &_s)
+{
+    for (unsigned int i=0; i<_s.size(); i++) {
+        if (tx_burst_retunes(_s[i]))
+            return true;
+    }
+    return false;
+}
+
+// repeat the schedule once for every frequency _f0, _f0+_step, ... up to
+// _f1, retuning before the first burst of each repetition
+inline bool tx_schedule_sweep(std::vector<tx_burst_entry> *_s,
+                              double _f0,
+                              double _f1,
+                              double _step)
+{
+    if (_step <= 0.0 || _f1 < _f0 || _f0 <= 0.0) {
+        fprintf(stderr,"error: frequency sweep needs 0 < start <= stop and a positive step\n");
+        return false;
+    }
+    std::vector<tx_burst_entry> base(*_s);
+    _s->clear();
+    unsigned int num_steps = (unsigned int)floor((_f1 - _f0) / _step + 1e-9) + 1;
+    for (unsigned int k=0; k<num_steps; k++) {
+        for (unsigned int i=0; i<base.size(); i++) {
+            tx_burst_entry e = base[i];
+            if (i == 0)
+                e.frequency = _f0 + k*_step;
+            _s->push_back(e);
+        }
+    }
+    return true;
+}
+
+#endif // __TX_SCHEDULE_H__
@@ -0,0 +1,126 @@
+/*
+ * tx_timestamps.h
+ *
+ * map transmit events onto Noctar sample indices
+ *
+ * The transmit thread stamps every tx_stream->send() call and the EOB
+ * with CLOCK_MONOTONIC_RAW and appends them to a pre-allocated event
+ * log.  The Noctar reader stamps every read() completion with the same
+ * clock; each pending event whose time falls between two completions is
+ * given a sample index by linear interpolation between the sample
+ * counters at those completions.  Events are published lock-free (one
+ * writer, one reader), so neither thread ever blocks on the other.
+ */
+
+#ifndef __TX_TIMESTAMPS_H__
+#define __TX_TIMESTAMPS_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <ostream>
+#include <vector>
+
+// CLOCK_MONOTONIC_RAW in nanoseconds: not slewed by NTP, and read via
+// the vdso on current kernels so it is cheap enough to call per read
+inline uint64_t noctar_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+enum tx_event_type {
+    TX_EVENT_SEND = 0,          // send() of a data buffer called
+    TX_EVENT_EOB,               // send() of the EOB packet called
+    TX_EVENT_EOB_DONE           // send() of the EOB packet returned
+};
+
+inline const char *tx_event_name(int _type)
+{
+    switch (_type) {
+    case TX_EVENT_SEND:     return "send";
+    case TX_EVENT_EOB:      return "eob";
+    case TX_EVENT_EOB_DONE: return "eob_done";
+    default:                return "unknown";
+    }
+}
+
+struct tx_event {
+    int type;                   // tx_event_type
+    uint64_t ns;                // CLOCK_MONOTONIC_RAW [ns]
+    double sample;              // interpolated Noctar sample index
+    bool mapped;                // sample is valid
+};
+
+struct tx_event_log {
+    std::vector<tx_event> events;   // pre-allocated, never resized
+    unsigned int count;             // published events (writer side)
+    unsigned int cursor;            // next event to map (reader side)
+    unsigned int overflows;         // events lost to a full log
+
+    // last read completion seen by the reader
+    uint64_t last_ns;
+    int64_t last_sample;
+};
+
+inline void tx_event_log_init(tx_event_log *_log, unsigned int _capacity)
+{
+    _log->events.resize(_capacity);
+    _log->count     = 0;
+    _log->cursor    = 0;
+    _log->overflows = 0;
+    _log->last_ns     = noctar_clock_ns();
+    _log->last_sample = 0;
+}
+
+// transmit side: stamp and publish an event
+inline void tx_event_log_push(tx_event_log *_log, int _type)
+{
+    uint64_t ns = noctar_clock_ns();
+    unsigned int n = _log->count;
+    if (n == _log->events.size()) {
+        _log->overflows++;
+        return;
+    }
+    _log->events[n].type   = _type;
+    _log->events[n].ns     = ns;
+    _log->events[n].sample = 0.0;
+    _log->events[n].mapped = false;
+    __atomic_store_n(&_log->count, n + 1, __ATOMIC_RELEASE);
+}
+
+// reader side: a read completed at _ns, leaving the sample counter at
+// _sample; map every published event up to _ns
+inline void tx_event_log_read_done(tx_event_log *_log, uint64_t _ns, int64_t _sample)
+{
+    unsigned int count = __atomic_load_n(&_log->count, __ATOMIC_ACQUIRE);
+    while (_log->cursor < count) {
+        tx_event &e = _log->events[_log->cursor];
+        if (e.ns > _ns)
+            break;
+
+        double span = (double)(_ns - _log->last_ns);
+        double frac = span > 0.0 && e.ns > _log->last_ns ? (e.ns - _log->last_ns) / span : 0.0;
+        e.sample = _log->last_sample + frac * (double)(_sample - _log->last_sample);
+        e.mapped = true;
+        _log->cursor++;
+    }
+    _log->last_ns     = _ns;
+    _log->last_sample = _sample;
+}
+
+// one line per event: type, clock [ns] and Noctar sample index
+inline void tx_event_log_write(std::ostream &_os, const tx_event_log *_log)
+{
+    unsigned int count = __atomic_load_n(&_log->count, __ATOMIC_ACQUIRE);
+    _os << "tx events: " << count << " lost: " << _log->overflows << std::endl;
+    for (unsigned int i=0; i<count; i++) {
+        const tx_event &e = _log->events[i];
+        _os << "tx event: " << tx_event_name(e.type) << " ns: " << e.ns << " sample: ";
+        if (e.mapped) _os << std::fixed << e.sample << std::defaultfloat;
+        else          _os << "unmapped";
+        _os << std::endl;
+    }
+}
+
+#endif // __TX_TIMESTAMPS_H__
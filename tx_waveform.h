@@ -0,0 +1,170 @@
+/*
+ * tx_waveform.h
+ *
+ * pre-built transmit waveform
+ *
+ * The whole scaled burst lives in one contiguous, 64-byte aligned
+ * allocation owned by the tx_waveform.  It is cut into chunks of at
+ * most tx_stream->get_max_num_samps() samples (the last one shorter), and
+ * for every chunk a per-channel pointer list is kept so send() can be
+ * handed a buffs_type without building anything at transmit time.  Every
+ * channel sends the same samples.
+ *
+ * The burst is built as fc32 and can then be quantized once to the
+ * streamer's cpu format (sc16 or sc8), so send() hands the samples over
+ * without a float conversion per packet.
+ *
+ * Both copies live in locked, pre-faulted arenas (noctar_arena.h), so
+ * the first pass of send() over the burst takes no page faults.
+ */
+
+#ifndef __TX_WAVEFORM_H__
+#define __TX_WAVEFORM_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <complex>
+#include <vector>
+
+#include <uhd/stream.hpp>
+
+#include "tx_convert.h"
+#include "noctar_arena.h"
+
+#define TX_WAVEFORM_ALIGN 64
+
+struct tx_waveform_chunk {
+    size_t offset;              // first sample of the chunk
+    size_t num_samples;         // samples in the chunk
+};
+
+struct tx_waveform {
+    std::complex<float> *samples;   // fc32 burst, TX_WAVEFORM_ALIGN aligned
+                                    // (NULL once quantized)
+    void *data;                     // what send() reads: samples, or the
+                                    // quantized copy
+    noctar_arena samples_arena;     // backing of samples
+    noctar_arena data_arena;        // backing of the quantized copy
+    size_t sample_bytes;            // bytes per sample in data
+    size_t num_samples;
+    unsigned int num_channels;
+
+    std::vector<tx_waveform_chunk> chunks;
+    std::vector<const void *> views;    // chunks.size() x num_channels
+};
+
+// bytes per complex sample of a uhd cpu format, 0 if not supported here
+inline size_t tx_format_sample_bytes(const char *_format)
+{
+    if (strcmp(_format, "fc32") == 0) return 8;
+    if (strcmp(_format, "sc16") == 0) return 4;
+    if (strcmp(_format, "sc8")  == 0) return 2;
+    return 0;
+}
+
+// aligned, zeroed, locked allocation
+inline void *tx_waveform_alloc(noctar_arena *_arena, size_t _bytes)
+{
+    if (!noctar_arena_create(_arena, _bytes, TX_WAVEFORM_ALIGN)) {
+        fprintf(stderr,"error: tx_waveform_alloc(), could not allocate %zu bytes\n", _bytes);
+        return NULL;
+    }
+    return _arena->base;
+}
+
+// per-channel pointers for every chunk of data
+inline void tx_waveform_set_views(tx_waveform *_w)
+{
+    _w->views.clear();
+    for (size_t k=0; k<_w->chunks.size(); k++) {
+        const char *p = (const char*)_w->data + _w->chunks[k].offset * _w->sample_bytes;
+        for (unsigned int ch=0; ch<_w->num_channels; ch++)
+            _w->views.push_back(p);
+    }
+}
+
+// allocate a zeroed burst of _num_samples and cut it into chunks of at
+// most _max_chunk samples
+inline bool tx_waveform_create(tx_waveform *_w,
+                               size_t _num_samples,
+                               unsigned int _num_channels,
+                               size_t _max_chunk)
+{
+    _w->samples      = NULL;
+    _w->data         = NULL;
+    _w->sample_bytes = sizeof(std::complex<float>);
+    _w->num_samples  = _num_samples;
+    _w->num_channels = _num_channels;
+    if (_num_samples == 0 || _num_channels == 0 || _max_chunk == 0) {
+        fprintf(stderr,"error: tx_waveform_create(), empty waveform\n");
+        return false;
+    }
+
+    _w->samples = (std::complex<float>*)tx_waveform_alloc(&_w->samples_arena, _num_samples * _w->sample_bytes);
+    if (_w->samples == NULL)
+        return false;
+    _w->data = _w->samples;
+
+    _w->chunks.clear();
+    for (size_t offset=0; offset<_num_samples; offset+=_max_chunk) {
+        tx_waveform_chunk c;
+        c.offset      = offset;
+        c.num_samples = _num_samples - offset < _max_chunk ? _num_samples - offset : _max_chunk;
+        _w->chunks.push_back(c);
+    }
+    tx_waveform_set_views(_w);
+    return true;
+}
+
+// convert the fc32 burst (full scale 1.0) to _format, on up to
+// _num_threads threads, and release the fc32 copy; fc32 is a no-op
+inline bool tx_waveform_quantize(tx_waveform *_w, const char *_format, unsigned int _num_threads)
+{
+    int op;
+    float full_scale;
+    if      (strcmp(_format, "fc32") == 0) return true;
+    else if (strcmp(_format, "sc16") == 0) { op = TX_CONVERT_CF32_SC16; full_scale = 32767.0f; }
+    else if (strcmp(_format, "sc8")  == 0) { op = TX_CONVERT_CF32_SC8;  full_scale = 127.0f;   }
+    else {
+        fprintf(stderr,"error: tx_waveform_quantize(), unsupported format '%s'\n", _format);
+        return false;
+    }
+    if (_w->samples == NULL) {
+        fprintf(stderr,"error: tx_waveform_quantize(), waveform already quantized\n");
+        return false;
+    }
+
+    size_t sample_bytes = tx_format_sample_bytes(_format);
+    void *q = tx_waveform_alloc(&_w->data_arena, _w->num_samples * sample_bytes);
+    if (q == NULL)
+        return false;
+    tx_convert_parallel(op, (const float*)_w->samples, q, full_scale, 2*_w->num_samples, _num_threads);
+
+    noctar_arena_destroy(&_w->samples_arena);
+    _w->samples      = NULL;
+    _w->data         = q;
+    _w->sample_bytes = sample_bytes;
+    tx_waveform_set_views(_w);
+    return true;
+}
+
+inline void tx_waveform_destroy(tx_waveform *_w)
+{
+    if (_w->data != NULL && _w->data != _w->samples)
+        noctar_arena_destroy(&_w->data_arena);
+    if (_w->samples != NULL)
+        noctar_arena_destroy(&_w->samples_arena);
+    _w->samples = NULL;
+    _w->data    = NULL;
+    _w->chunks.clear();
+    _w->views.clear();
+}
+
+// per-channel buffers of chunk _k, ready for tx_streamer::send()
+inline uhd::tx_streamer::buffs_type tx_waveform_buffs(const tx_waveform *_w, size_t _k)
+{
+    return uhd::tx_streamer::buffs_type(&_w->views[_k * _w->num_channels], _w->num_channels);
+}
+
+#endif // __TX_WAVEFORM_H__
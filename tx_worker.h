@@ -0,0 +1,151 @@
+/*
+ * tx_worker.h
+ *
+ * persistent transmit worker
+ *
+ * Instead of creating a thread when the receive loop decides to
+ * transmit, one worker thread is created at startup (optionally pinned
+ * to a cpu, at SCHED_FIFO priority just below the Noctar reader) and
+ * waits for triggers.  A trigger bumps a sequence number; the worker
+ * either spins on it (when pinned to its own cpu) or sleeps on it with
+ * a futex, runs one burst per trigger and bumps a completion counter
+ * that the receive loop polls.  Any number of bursts can be triggered.
+ */
+
+#ifndef __TX_WORKER_H__
+#define __TX_WORKER_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "noctar_futex.h"
+
+// runs one burst; called on the worker thread
+typedef void *(*tx_burst_func)(void *_arg);
+
+struct tx_worker {
+    tx_burst_func burst;
+    void *arg;
+
+    unsigned int trigger_seq;   // bumped per trigger (futex word)
+    unsigned int done_seq;      // bumped per completed burst
+    int quit;
+
+    int cpu;                    // cpu to pin to (-1: none)
+    bool spin;                  // busy-wait for triggers instead of sleeping
+    bool realtime;              // running at SCHED_FIFO
+
+    pthread_t thread;
+};
+
+inline void *tx_worker_thread(void *_arg)
+{
+    tx_worker *w = (tx_worker*)_arg;
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            fprintf(stderr,"warning: tx worker could not be pinned to cpu %d\n", w->cpu);
+    }
+
+    unsigned int seen = 0;
+    while (true) {
+        unsigned int seq = __atomic_load_n(&w->trigger_seq, __ATOMIC_ACQUIRE);
+        if (seq == seen) {
+            if (w->spin) {
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#endif
+            } else {
+                noctar_futex_wait(&w->trigger_seq, seen);
+            }
+            continue;
+        }
+
+        // stop() bumps the sequence once more after setting quit
+        if (__atomic_load_n(&w->quit, __ATOMIC_ACQUIRE))
+            break;
+
+        seen++;
+        w->burst(w->arg);
+        __atomic_store_n(&w->done_seq, w->done_seq + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// create the worker; it spins only when pinned to a cpu (spinning at
+// SCHED_FIFO on a shared cpu would starve the reader)
+inline bool tx_worker_start(tx_worker *_w,
+                            tx_burst_func _burst,
+                            void *_arg,
+                            int _cpu)
+{
+    _w->burst       = _burst;
+    _w->arg         = _arg;
+    _w->trigger_seq = 0;
+    _w->done_seq    = 0;
+    _w->quit        = 0;
+    _w->cpu         = _cpu;
+    _w->spin        = _cpu >= 0;
+    _w->realtime    = false;
+
+    // SCHED_FIFO one step below the reader, so acquisition always wins
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    struct sched_param params;
+    params.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &params);
+
+    int ret = pthread_create(&_w->thread, &attr, tx_worker_thread, (void*)_w);
+    pthread_attr_destroy(&attr);
+    if (ret == 0) {
+        _w->realtime = true;
+        return true;
+    }
+
+    // not permitted: run at normal priority, and never spin
+    fprintf(stderr,"warning: tx worker could not get SCHED_FIFO (%s)\n", strerror(ret));
+    _w->spin = false;
+    if (pthread_create(&_w->thread, NULL, tx_worker_thread, (void*)_w) != 0) {
+        fprintf(stderr,"error: could not create tx worker\n");
+        return false;
+    }
+    return true;
+}
+
+// start one burst
+inline void tx_worker_trigger(tx_worker *_w)
+{
+    __atomic_add_fetch(&_w->trigger_seq, 1, __ATOMIC_RELEASE);
+    if (!_w->spin)
+        noctar_futex_wake(&_w->trigger_seq);
+}
+
+// number of bursts completed so far
+inline unsigned int tx_worker_done(tx_worker *_w)
+{
+    return __atomic_load_n(&_w->done_seq, __ATOMIC_ACQUIRE);
+}
+
+// let triggered bursts finish, then stop and join the worker
+inline void tx_worker_stop(tx_worker *_w)
+{
+    unsigned int triggered = __atomic_load_n(&_w->trigger_seq, __ATOMIC_ACQUIRE);
+    while (tx_worker_done(_w) < triggered)
+        usleep(1000);
+
+    // the extra sequence bump wakes the worker, which sees quit first
+    __atomic_store_n(&_w->quit, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&_w->trigger_seq, 1, __ATOMIC_RELEASE);
+    noctar_futex_wake(&_w->trigger_seq);
+    pthread_join(_w->thread, NULL);
+}
+
+#endif // __TX_WORKER_H__